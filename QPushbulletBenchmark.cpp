@@ -0,0 +1,281 @@
+#include "QPushbulletBenchmark.h"
+#include "QPushbulletLogging.h"
+#include <QDebug>
+#include <algorithm>
+
+static const char *BENCHMARK_API_KEY = "benchmark";
+
+QPushbulletBenchmark::QPushbulletBenchmark(QObject *parent)
+    : QObject(parent)
+    , m_Server(BENCHMARK_API_KEY)
+{
+    if (!m_Server.listen())
+        qCWarning(lcPushbulletTools) << "Benchmark server couldn't listen";
+}
+
+QPushbulletHandler *QPushbulletBenchmark::createHandler()
+{
+    QPushbulletHandler *handler = new QPushbulletHandler(BENCHMARK_API_KEY);
+    handler->setAPIBaseURL(m_Server.getAPIBaseURL());
+    handler->setStreamBaseURL(m_Server.getStreamBaseURL());
+    return handler;
+}
+
+bool QPushbulletBenchmark::waitFor(QObject *sender, const char *signal, int timeoutMsecs)
+{
+    QEventLoop loop;
+    QTimer timer;
+    timer.setSingleShot(true);
+    connect(&timer, SIGNAL(timeout()), &loop, SLOT(quit()));
+    connect(sender, signal, &loop, SLOT(quit()));
+    timer.start(timeoutMsecs);
+    loop.exec();
+    return timer.isActive();
+}
+
+void QPushbulletBenchmark::fillPercentiles(BenchmarkResult &result, QList<qint64> samples)
+{
+    if (samples.isEmpty())
+        return;
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](double p) {
+        const int index = qMin(samples.count() - 1, static_cast<int>(p * samples.count()));
+        return samples.at(index);
+    };
+    result.p50 = percentile(0.50);
+    result.p90 = percentile(0.90);
+    result.p99 = percentile(0.99);
+}
+
+qint64 QPushbulletBenchmark::getResidentMemory()
+{
+#ifdef Q_OS_LINUX
+    QFile status("/proc/self/status");
+    if (!status.open(QIODevice::ReadOnly))
+        return -1;
+
+    for (const QByteArray &line : status.readAll().split('\n')) {
+        if (line.startsWith("VmRSS:"))
+            return line.mid(6).trimmed().split(' ').first().toLongLong() * 1024;
+    }
+#endif
+    return -1;
+}
+
+BenchmarkResultList QPushbulletBenchmark::runHistorySync(QList<int> historySizes, int iterations)
+{
+    BenchmarkResultList results;
+    for (int size : historySizes) {
+        m_Server.seed(10, 10, size);
+
+        BenchmarkResult result;
+        result.name = "history_sync";
+        result.size = size;
+        result.iterations = iterations;
+
+        const qint64 memoryBefore = getResidentMemory();
+        QPushbulletHandler *handler = createHandler();
+        QList<qint64> samples;
+        QElapsedTimer timer;
+        for (int i = 0; i < iterations; i++) {
+            timer.start();
+            handler->requestPushHistory();
+            if (!waitFor(handler, SIGNAL(didReceivePushHistory(PushList)), 600000)) {
+                qCWarning(lcPushbulletTools) << "History sync timed out for" << size << "pushes";
+                break;
+            }
+            samples.append(timer.nsecsElapsed() / 1000);
+        }
+
+        if (memoryBefore >= 0)
+            result.memoryBytes = getResidentMemory() - memoryBefore;
+        fillPercentiles(result, samples);
+        if (result.p50 > 0)
+            result.itemsPerSecond = size / (result.p50 / 1000000.0);
+
+        delete handler;
+        results.append(result);
+    }
+
+    m_Server.seed(0, 0, 0);
+    return results;
+}
+
+BenchmarkResult QPushbulletBenchmark::runPushThroughput(int count)
+{
+    m_Server.seed(10, 10, 0);
+    BenchmarkResult result;
+    result.name = "push";
+    result.size = count;
+    result.iterations = count;
+
+    const qint64 memoryBefore = getResidentMemory();
+    QPushbulletHandler *handler = createHandler();
+    Push push;
+    push.type = PUSH_TYPE::NOTE;
+    push.title = "Benchmark";
+    push.body = "Benchmark push";
+
+    QList<qint64> samples;
+    QElapsedTimer total, timer;
+    total.start();
+    for (int i = 0; i < count; i++) {
+        timer.start();
+        handler->requestPushToAllDevices(push);
+        if (!waitFor(handler, SIGNAL(didPush(Push)), 30000))
+            break;
+        samples.append(timer.nsecsElapsed() / 1000);
+    }
+
+    if (!samples.isEmpty())
+        result.itemsPerSecond = samples.count() / (total.nsecsElapsed() / 1000000000.0);
+    if (memoryBefore >= 0)
+        result.memoryBytes = getResidentMemory() - memoryBefore;
+    fillPercentiles(result, samples);
+
+    delete handler;
+    return result;
+}
+
+BenchmarkResult QPushbulletBenchmark::runMirrorThroughput(int count)
+{
+    return measureMirrors(createHandler(), "mirror", count);
+}
+
+BenchmarkResult QPushbulletBenchmark::runEncryptedMirrorThroughput(int count)
+{
+    m_Server.setEncryptionPassword(BENCHMARK_API_KEY);
+    QPushbulletHandler *handler = createHandler();
+    handler->setEncryptionPassword(BENCHMARK_API_KEY);
+    if (!waitFor(handler, SIGNAL(didEnableEncryption()), 30000))
+        qCWarning(lcPushbulletTools) << "Benchmark encryption key wasn't derived";
+
+    BenchmarkResult result = measureMirrors(handler, "encrypted_mirror", count);
+    m_Server.setEncryptionPassword(QString());
+    return result;
+}
+
+BenchmarkResult QPushbulletBenchmark::runDeviceSync(int count)
+{
+    m_Server.seed(100, 100, 0);
+    BenchmarkResult result;
+    result.name = "device_sync";
+    result.size = count;
+    result.iterations = count;
+
+    QPushbulletHandler *handler = createHandler();
+    handler->requestDeviceList();
+    bool ok = waitFor(handler, SIGNAL(didReceiveDevices(DeviceList)), 30000);
+    handler->requestContactList();
+    ok = ok && waitFor(handler, SIGNAL(didReceiveContacts(ContactList)), 30000);
+    handler->registerForRealTimeEventStream();
+    QWebSocket *socket = handler->findChild<QWebSocket *>();
+    if (!ok || !socket || !waitFor(socket, SIGNAL(connected()), 10000)) {
+        qCWarning(lcPushbulletTools) << "Benchmark device sync couldn't start";
+        delete handler;
+        return result;
+    }
+
+    const qint64 memoryBefore = getResidentMemory();
+    QList<qint64> samples;
+    QElapsedTimer total, timer;
+    total.start();
+    for (int i = 0; i < count; i++) {
+        timer.start();
+        //The device tickle makes the handler fetch the device delta, the contacts are fetched like an app would
+        m_Server.sendDeviceChanges(1);
+        if (!waitFor(handler, SIGNAL(didReceiveDevices(DeviceList)), 30000))
+            break;
+        handler->requestContactList();
+        if (!waitFor(handler, SIGNAL(didReceiveContacts(ContactList)), 30000))
+            break;
+        samples.append(timer.nsecsElapsed() / 1000);
+    }
+
+    //The lists changed since their ETag, so the first full fetch downloads them and the second one gets a 304
+    handler->setFullListInterval(0);
+    for (int i = 0; i < 2; i++) {
+        handler->requestDeviceList();
+        waitFor(handler, SIGNAL(didReceiveDevices(DeviceList)), 30000);
+        handler->requestContactList();
+        waitFor(handler, SIGNAL(didReceiveContacts(ContactList)), 30000);
+    }
+
+    if (!samples.isEmpty())
+        result.itemsPerSecond = samples.count() / (total.nsecsElapsed() / 1000000000.0);
+    if (memoryBefore >= 0)
+        result.memoryBytes = getResidentMemory() - memoryBefore;
+    fillPercentiles(result, samples);
+
+    delete handler;
+    m_Server.seed(0, 0, 0);
+    return result;
+}
+
+BenchmarkResult QPushbulletBenchmark::measureMirrors(QPushbulletHandler *handler, const QString &name, int count)
+{
+    BenchmarkResult result;
+    result.name = name;
+    result.size = count;
+    result.iterations = 1;
+
+    handler->registerForRealTimeEventStream();
+    QWebSocket *socket = handler->findChild<QWebSocket *>();
+    if (!socket || !waitFor(socket, SIGNAL(connected()), 10000)) {
+        qCWarning(lcPushbulletTools) << "Benchmark stream couldn't connect";
+        delete handler;
+        return result;
+    }
+
+    //Mirrors are delivered in the order they were sent, so the nth one received is matched with the nth send time
+    QElapsedTimer timer;
+    QVector<qint64> sentAt;
+    sentAt.reserve(count);
+    QList<qint64> samples;
+    QEventLoop loop;
+    connect(handler, &QPushbulletHandler::didReceiveMirrorPush, &loop, [&]() {
+        samples.append((timer.nsecsElapsed() - sentAt.at(samples.count())) / 1000);
+        if (samples.count() == count)
+            loop.quit();
+    });
+    QTimer::singleShot(600000, &loop, SLOT(quit()));
+
+    const qint64 memoryBefore = getResidentMemory();
+    timer.start();
+    for (int i = 0; i < count; i++) {
+        sentAt.append(timer.nsecsElapsed());
+        m_Server.sendMirrors(1);
+    }
+    if (samples.count() < count)
+        loop.exec();
+
+    const qint64 elapsed = timer.nsecsElapsed() / 1000;
+    if (elapsed > 0)
+        result.itemsPerSecond = samples.count() / (elapsed / 1000000.0);
+    fillPercentiles(result, samples);
+    if (memoryBefore >= 0)
+        result.memoryBytes = getResidentMemory() - memoryBefore;
+
+    delete handler;
+    return result;
+}
+
+void QPushbulletBenchmark::setLatency(int msecs)
+{
+    m_Server.setLatency(msecs);
+}
+
+QString QPushbulletBenchmark::toText(const BenchmarkResultList &results)
+{
+    QString text;
+    QTextStream stream(&text);
+    stream << QString("%1 %2 %3 %4 %5 %6 %7\n").arg("benchmark", -14).arg("size", 9).arg("items/s", 12)
+           .arg("p50 us", 10).arg("p90 us", 10).arg("p99 us", 10).arg("memory KiB", 11);
+    for (const BenchmarkResult &result : results) {
+        stream << QString("%1 %2 %3 %4 %5 %6 %7\n").arg(result.name, -14).arg(result.size, 9)
+               .arg(result.itemsPerSecond, 12, 'f', 1).arg(result.p50, 10).arg(result.p90, 10).arg(result.p99, 10)
+               .arg(result.memoryBytes < 0 ? -1 : result.memoryBytes / 1024, 11);
+    }
+    return text;
+}
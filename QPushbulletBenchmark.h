@@ -0,0 +1,79 @@
+#ifndef PUSHBULLETBENCHMARK_H
+#define PUSHBULLETBENCHMARK_H
+#include <QObject>
+#include "QPushbulletHandler.h"
+#include "QPushbulletMockServer.h"
+
+struct BenchmarkResult {
+    QString name;
+    int size = 0, iterations = 0;
+    double itemsPerSecond = 0;
+    //Latency percentiles in microseconds
+    qint64 p50 = 0, p90 = 0, p99 = 0;
+    //Growth of the resident set size during the run, -1 if it cannot be read on this platform
+    qint64 memoryBytes = -1;
+};
+
+typedef QList<BenchmarkResult> BenchmarkResultList;
+
+/**
+ * @brief Runs QPushbulletHandler against a QPushbulletMockServer and measures sync latency, push throughput and memory.
+ * The run functions spin a local event loop, so call them from a QCoreApplication before or instead of exec().
+ */
+class QPushbulletBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    QPushbulletBenchmark(QObject *parent = nullptr);
+
+private:
+    QPushbulletMockServer m_Server;
+
+private:
+    QPushbulletHandler *createHandler();
+    bool waitFor(QObject *sender, const char *signal, int timeoutMsecs);
+    void fillPercentiles(BenchmarkResult &result, QList<qint64> samples);
+    BenchmarkResult measureMirrors(QPushbulletHandler *handler, const QString &name, int count);
+
+public:
+    static qint64 getResidentMemory();
+
+    /**
+     * @brief Syncs histories of the given sizes, iterations times each
+     * @param historySizes e.g. {1000, 10000, 100000, 1000000}
+     * @param iterations
+     * @return
+     */
+    BenchmarkResultList runHistorySync(QList<int> historySizes, int iterations = 5);
+    /**
+     * @brief Sends count note pushes one after the other and measures pushes per second
+     * @param count
+     * @return
+     */
+    BenchmarkResult runPushThroughput(int count = 500);
+    /**
+     * @brief Sends count mirrors through the stream and measures how fast the handler decodes them
+     * @param count
+     * @return
+     */
+    BenchmarkResult runMirrorThroughput(int count = 10000);
+    /**
+     * @brief Like runMirrorThroughput() with end-to-end encrypted mirrors, which are decrypted on the handler's pool
+     * @param count
+     * @return
+     */
+    BenchmarkResult runEncryptedMirrorThroughput(int count = 10000);
+    /**
+     * @brief Changes a device and a contact count times and measures how long the handler takes to fetch the deltas,
+     * starting from the device tickle. The lists are revalidated in full with their ETag at the end.
+     * @param count
+     * @return
+     */
+    BenchmarkResult runDeviceSync(int count = 100);
+
+    void setLatency(int msecs);
+    static QString toText(const BenchmarkResultList &results);
+};
+
+#endif // PUSHBULLETBENCHMARK_H
@@ -0,0 +1,154 @@
+#include "QPushbulletCrypto.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+static const int TAG_SIZE = 16;
+static const int IV_SIZE = 12;
+static const char VERSION = '1';
+
+QHash<QByteArray, QByteArray> QPushbulletCrypto::s_KeyCache;
+QMutex QPushbulletCrypto::s_KeyCacheMutex;
+unsigned char QPushbulletCrypto::s_KeyCacheSecret[KEY_SIZE];
+bool QPushbulletCrypto::s_HasKeyCacheSecret = false;
+
+QPushbulletCrypto::QPushbulletCrypto(const QByteArray &password, const QByteArray &userID)
+    : m_HasKey(false)
+{
+    QMutexLocker locker(&s_KeyCacheMutex);
+    const QByteArray cacheKey = getCacheKey(password, userID);
+    auto cachedIt = cacheKey.isEmpty() ? s_KeyCache.constEnd() : s_KeyCache.constFind(cacheKey);
+    if (cachedIt != s_KeyCache.constEnd()) {
+        memcpy(m_Key, cachedIt.value().constData(), KEY_SIZE);
+        m_HasKey = true;
+        return;
+    }
+    locker.unlock();
+
+    m_HasKey = PKCS5_PBKDF2_HMAC(password.constData(), password.size(),
+                                 reinterpret_cast<const unsigned char *>(userID.constData()), userID.size(), ITERATIONS,
+                                 EVP_sha256(), KEY_SIZE, m_Key) == 1;
+    if (!m_HasKey) {
+        OPENSSL_cleanse(m_Key, KEY_SIZE);
+        return;
+    }
+
+    locker.relock();
+    //Cleared in the meantime, the key is computed again with the new secret
+    const QByteArray newCacheKey = getCacheKey(password, userID);
+    if (!newCacheKey.isEmpty())
+        s_KeyCache.insert(newCacheKey, QByteArray(reinterpret_cast<const char *>(m_Key), KEY_SIZE));
+}
+
+QByteArray QPushbulletCrypto::getCacheKey(const QByteArray &password, const QByteArray &userID)
+{
+    //A keyed hash with a secret that never leaves the process, so a cache key can't be used to check password guesses
+    if (!s_HasKeyCacheSecret) {
+        s_HasKeyCacheSecret = RAND_bytes(s_KeyCacheSecret, KEY_SIZE) == 1;
+        if (!s_HasKeyCacheSecret)
+            return QByteArray();
+    }
+
+    QByteArray data = userID;
+    data.append('\0');
+    data.append(password);
+    QByteArray cacheKey(EVP_MAX_MD_SIZE, Qt::Uninitialized);
+    unsigned int length = 0;
+    const bool ok = HMAC(EVP_sha256(), s_KeyCacheSecret, KEY_SIZE,
+                         reinterpret_cast<const unsigned char *>(data.constData()), data.size(),
+                         reinterpret_cast<unsigned char *>(cacheKey.data()), &length) != nullptr;
+    OPENSSL_cleanse(data.data(), data.size());
+    if (!ok)
+        return QByteArray();
+    cacheKey.resize(length);
+    return cacheKey;
+}
+
+QPushbulletCrypto::~QPushbulletCrypto()
+{
+    OPENSSL_cleanse(m_Key, KEY_SIZE);
+}
+
+bool QPushbulletCrypto::hasKey() const
+{
+    return m_HasKey;
+}
+
+QByteArray QPushbulletCrypto::encrypt(const QByteArray &plaintext) const
+{
+    if (!m_HasKey)
+        return QByteArray();
+
+    QByteArray message(1 + TAG_SIZE + IV_SIZE + plaintext.size(), Qt::Uninitialized);
+    message[0] = VERSION;
+    unsigned char *tag = reinterpret_cast<unsigned char *>(message.data()) + 1;
+    unsigned char *iv = tag + TAG_SIZE;
+    unsigned char *ciphertext = iv + IV_SIZE;
+    if (RAND_bytes(iv, IV_SIZE) != 1)
+        return QByteArray();
+
+    EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+    int length = 0, finalLength = 0;
+    const bool ok = context
+                    && EVP_EncryptInit_ex(context, EVP_aes_256_gcm(), nullptr, nullptr, nullptr) == 1
+                    && EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_SET_IVLEN, IV_SIZE, nullptr) == 1
+                    && EVP_EncryptInit_ex(context, nullptr, nullptr, m_Key, iv) == 1
+                    && EVP_EncryptUpdate(context, ciphertext, &length,
+                                         reinterpret_cast<const unsigned char *>(plaintext.constData()),
+                                         plaintext.size()) == 1
+                    && EVP_EncryptFinal_ex(context, ciphertext + length, &finalLength) == 1
+                    && EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, tag) == 1;
+    EVP_CIPHER_CTX_free(context);
+    return ok ? message.toBase64() : QByteArray();
+}
+
+QByteArray QPushbulletCrypto::decrypt(const QByteArray &message, bool *ok) const
+{
+    if (ok)
+        *ok = false;
+    const QByteArray decoded = QByteArray::fromBase64(message);
+    if (!m_HasKey || decoded.size() < 1 + TAG_SIZE + IV_SIZE || decoded.at(0) != VERSION)
+        return QByteArray();
+
+    const unsigned char *tag = reinterpret_cast<const unsigned char *>(decoded.constData()) + 1;
+    const unsigned char *iv = tag + TAG_SIZE;
+    const unsigned char *ciphertext = iv + IV_SIZE;
+    const int ciphertextSize = decoded.size() - 1 - TAG_SIZE - IV_SIZE;
+
+    QByteArray plaintext(ciphertextSize, Qt::Uninitialized);
+    unsigned char *output = reinterpret_cast<unsigned char *>(plaintext.data());
+    EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+    int length = 0, finalLength = 0;
+    //The tag is checked in EVP_DecryptFinal_ex, so a tampered message or a wrong key fails there
+    const bool decrypted = context
+                           && EVP_DecryptInit_ex(context, EVP_aes_256_gcm(), nullptr, nullptr, nullptr) == 1
+                           && EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_SET_IVLEN, IV_SIZE, nullptr) == 1
+                           && EVP_DecryptInit_ex(context, nullptr, nullptr, m_Key, iv) == 1
+                           && EVP_DecryptUpdate(context, output, &length, ciphertext, ciphertextSize) == 1
+                           && EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_SET_TAG, TAG_SIZE,
+                                                  const_cast<unsigned char *>(tag)) == 1
+                           && EVP_DecryptFinal_ex(context, output + length, &finalLength) == 1;
+    EVP_CIPHER_CTX_free(context);
+    if (!decrypted)
+        return QByteArray();
+
+    plaintext.resize(length + finalLength);
+    if (ok)
+        *ok = true;
+    return plaintext;
+}
+
+void QPushbulletCrypto::clearKeyCache()
+{
+    QMutexLocker locker(&s_KeyCacheMutex);
+    for (auto it = s_KeyCache.begin(); it != s_KeyCache.end(); ++it) {
+        OPENSSL_cleanse(it.value().data(), it.value().size());
+        //The hash isn't looked up again before clear(), and nothing else shares the lookup keys
+        OPENSSL_cleanse(const_cast<char *>(it.key().constData()), it.key().size());
+    }
+    s_KeyCache.clear();
+    //Lookup keys from before can't be recomputed with the next secret
+    OPENSSL_cleanse(s_KeyCacheSecret, KEY_SIZE);
+    s_HasKeyCacheSecret = false;
+}
@@ -0,0 +1,57 @@
+#ifndef PUSHBULLETCRYPTO_H
+#define PUSHBULLETCRYPTO_H
+#include <QtCore>
+#include <memory>
+
+/**
+ * @brief Pushbullet end-to-end encryption. The key is derived from the password with PBKDF2-HMAC-SHA256, salted with
+ * the user iden, and messages are AES-256-GCM encrypted in the "1" + tag + IV + ciphertext format, base64 encoded.
+ * encrypt() and decrypt() only read the key, so one instance can be used from many threads at once.
+ */
+class QPushbulletCrypto
+{
+    Q_DISABLE_COPY(QPushbulletCrypto)
+
+public:
+    static const int KEY_SIZE = 32;
+    static const int ITERATIONS = 30000;
+
+    QPushbulletCrypto(const QByteArray &password, const QByteArray &userID);
+    ~QPushbulletCrypto();
+
+private:
+    unsigned char m_Key[KEY_SIZE];
+    bool m_HasKey;
+
+    //Derived keys by an HMAC of the user and password, so a password is only stretched once per process
+    static QHash<QByteArray, QByteArray> s_KeyCache;
+    static QMutex s_KeyCacheMutex;
+    static unsigned char s_KeyCacheSecret[KEY_SIZE];
+    static bool s_HasKeyCacheSecret;
+
+    //Call with s_KeyCacheMutex locked. Empty if no secret could be made, then nothing is cached.
+    static QByteArray getCacheKey(const QByteArray &password, const QByteArray &userID);
+
+public:
+    bool hasKey() const;
+    /**
+     * @brief Encrypts plaintext with a random IV
+     * @return The base64 encoded message, or an empty array if it failed
+     */
+    QByteArray encrypt(const QByteArray &plaintext) const;
+    /**
+     * @brief Decrypts and authenticates a base64 encoded message
+     * @param ok Set to false if the message is malformed or was encrypted with another key
+     */
+    QByteArray decrypt(const QByteArray &message, bool *ok = nullptr) const;
+
+    /**
+     * @brief Wipes the cached keys, e.g. when the user signs out
+     */
+    static void clearKeyCache();
+};
+
+typedef std::shared_ptr<const QPushbulletCrypto> QPushbulletCryptoPointer;
+Q_DECLARE_METATYPE(QPushbulletCryptoPointer)
+
+#endif // PUSHBULLETCRYPTO_H
@@ -0,0 +1,149 @@
+#include "QPushbulletFileCache.h"
+#include "QPushbulletLogging.h"
+#include <QDebug>
+
+QPushbulletFileCache::QPushbulletFileCache(QString directory, qint64 maxSize)
+    : m_Directory(directory)
+    , m_MaxSize(maxSize)
+    , m_Size(0)
+    , m_UseCounter(0)
+{
+    if (!m_Directory.exists() && !QDir().mkpath(m_Directory.absolutePath()))
+        qCWarning(lcPushbulletTools) << "Couldn't create the file cache directory" << m_Directory.absolutePath();
+
+    //Sorted by modification time, so the files of an earlier run keep their relative order
+    const QFileInfoList files = m_Directory.entryInfoList(QDir::Files, QDir::Time | QDir::Reversed);
+    for (const QFileInfo &file : files) {
+        Entry entry;
+        entry.size = file.size();
+        entry.lastUsed = m_UseCounter++;
+        m_Entries.insert(file.fileName(), entry);
+        m_Order.insert(entry.lastUsed, file.fileName());
+        m_Size += entry.size;
+    }
+    evict();
+}
+
+QString QPushbulletFileCache::getFileName(const QString &key)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex());
+}
+
+void QPushbulletFileCache::touch(const QString &fileName, Entry &entry)
+{
+    m_Order.remove(entry.lastUsed);
+    entry.lastUsed = m_UseCounter++;
+    m_Order.insert(entry.lastUsed, fileName);
+}
+
+void QPushbulletFileCache::removeEntry(const QString &fileName)
+{
+    auto foundIt = m_Entries.find(fileName);
+    if (foundIt == m_Entries.end())
+        return;
+
+    m_Size -= foundIt.value().size;
+    m_Order.remove(foundIt.value().lastUsed);
+    m_Entries.erase(foundIt);
+    m_Directory.remove(fileName);
+}
+
+void QPushbulletFileCache::evict()
+{
+    while (m_Size > m_MaxSize && !m_Order.isEmpty())
+        removeEntry(m_Order.first());
+}
+
+bool QPushbulletFileCache::contains(const QString &key) const
+{
+    QMutexLocker locker(&m_Mutex);
+    return m_Entries.contains(getFileName(key));
+}
+
+QByteArray QPushbulletFileCache::get(const QString &key)
+{
+    const QString fileName = getFileName(key);
+    QMutexLocker locker(&m_Mutex);
+    auto foundIt = m_Entries.find(fileName);
+    if (foundIt == m_Entries.end())
+        return QByteArray();
+
+    QFile file(m_Directory.filePath(fileName));
+    if (!file.open(QIODevice::ReadOnly)) {
+        //Removed from outside, forget about it
+        removeEntry(fileName);
+        return QByteArray();
+    }
+    touch(fileName, foundIt.value());
+    return file.readAll();
+}
+
+bool QPushbulletFileCache::put(const QString &key, const QByteArray &data)
+{
+    const QString fileName = getFileName(key);
+    QMutexLocker locker(&m_Mutex);
+    if (data.size() > m_MaxSize)
+        return false;
+
+    //Written to a temporary file and renamed, so a reader never sees half a file
+    QSaveFile file(m_Directory.filePath(fileName));
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size() || !file.commit()) {
+        qCWarning(lcPushbulletTools) << "Couldn't write to the file cache" << file.errorString();
+        return false;
+    }
+
+    auto foundIt = m_Entries.find(fileName);
+    if (foundIt != m_Entries.end()) {
+        m_Size += data.size() - foundIt.value().size;
+        foundIt.value().size = data.size();
+        touch(fileName, foundIt.value());
+    }
+    else {
+        Entry entry;
+        entry.size = data.size();
+        entry.lastUsed = m_UseCounter++;
+        m_Entries.insert(fileName, entry);
+        m_Order.insert(entry.lastUsed, fileName);
+        m_Size += entry.size;
+    }
+    evict();
+    return true;
+}
+
+void QPushbulletFileCache::remove(const QString &key)
+{
+    QMutexLocker locker(&m_Mutex);
+    removeEntry(getFileName(key));
+}
+
+void QPushbulletFileCache::clear()
+{
+    QMutexLocker locker(&m_Mutex);
+    while (!m_Order.isEmpty())
+        removeEntry(m_Order.first());
+}
+
+qint64 QPushbulletFileCache::getSize() const
+{
+    QMutexLocker locker(&m_Mutex);
+    return m_Size;
+}
+
+qint64 QPushbulletFileCache::getMaxSize() const
+{
+    QMutexLocker locker(&m_Mutex);
+    return m_MaxSize;
+}
+
+void QPushbulletFileCache::setMaxSize(qint64 maxSize)
+{
+    QMutexLocker locker(&m_Mutex);
+    m_MaxSize = maxSize;
+    evict();
+}
+
+int QPushbulletFileCache::getCount() const
+{
+    QMutexLocker locker(&m_Mutex);
+    return m_Entries.count();
+}
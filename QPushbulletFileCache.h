@@ -0,0 +1,60 @@
+#ifndef PUSHBULLETFILECACHE_H
+#define PUSHBULLETFILECACHE_H
+#include <QtCore>
+
+/**
+ * @brief A size-bounded disk cache. Entries are files named after a hash of their key, and the least recently used
+ * ones are removed when the cache grows over its size. It's safe to use from several threads.
+ */
+class QPushbulletFileCache
+{
+    Q_DISABLE_COPY(QPushbulletFileCache)
+
+public:
+    /**
+     * @brief Opens the cache in the directory, creating it if needed. Files left by an earlier run are kept, the oldest
+     * modified ones are removed first.
+     * @param directory
+     * @param maxSize In bytes
+     */
+    QPushbulletFileCache(QString directory, qint64 maxSize = 100 * 1024 * 1024);
+
+private:
+    struct Entry {
+        qint64 size;
+        quint64 lastUsed;
+    };
+
+    QDir m_Directory;
+    qint64 m_MaxSize, m_Size;
+    //By file name. m_Order maps the use counter back to the file name so the least recently used is found quickly.
+    QHash<QString, Entry> m_Entries;
+    QMap<quint64, QString> m_Order;
+    quint64 m_UseCounter;
+    mutable QMutex m_Mutex;
+
+private:
+    static QString getFileName(const QString &key);
+    void touch(const QString &fileName, Entry &entry);
+    void removeEntry(const QString &fileName);
+    void evict();
+
+public:
+    bool contains(const QString &key) const;
+    /**
+     * @brief Returns the cached data, or an empty array if the key isn't cached
+     * @param key
+     * @return
+     */
+    QByteArray get(const QString &key);
+    bool put(const QString &key, const QByteArray &data);
+    void remove(const QString &key);
+    void clear();
+
+    qint64 getSize() const;
+    qint64 getMaxSize() const;
+    void setMaxSize(qint64 maxSize);
+    int getCount() const;
+};
+
+#endif // PUSHBULLETFILECACHE_H
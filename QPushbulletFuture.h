@@ -0,0 +1,72 @@
+#ifndef PUSHBULLETFUTURE_H
+#define PUSHBULLETFUTURE_H
+#include <QtCore>
+#include <QtNetwork>
+#include <memory>
+
+/**
+ * @brief Why a request failed. httpStatus is 0 when the request never got a reply.
+ */
+struct PushbulletError {
+    QNetworkReply::NetworkError networkError = QNetworkReply::NoError;
+    int httpStatus = 0;
+    QString message;
+    QByteArray response;
+
+    bool isError() const
+    {
+        return networkError != QNetworkReply::NoError;
+    }
+};
+
+/**
+ * @brief The result of one async request. value is only meaningful if isOk() returns true.
+ */
+template<typename T>
+struct PushbulletResult {
+    T value = T();
+    PushbulletError error;
+
+    bool isOk() const
+    {
+        return !error.isError();
+    }
+};
+
+/**
+ * @brief Returns a future that finishes when all the given futures have finished. Its result is the list of their
+ * results in the same order.
+ */
+template<typename T>
+QFuture<QList<T>> whenAll(const QList<QFuture<T>> &futures)
+{
+    std::shared_ptr<QFutureInterface<QList<T>>> futureInterface(new QFutureInterface<QList<T>>());
+    futureInterface->reportStarted();
+    if (futures.isEmpty()) {
+        futureInterface->reportResult(QList<T>());
+        futureInterface->reportFinished();
+        return futureInterface->future();
+    }
+
+    std::shared_ptr<int> remaining(new int(futures.count()));
+    auto finish = [futureInterface, futures]() {
+        QList<T> results;
+        for (const QFuture<T> &future : futures)
+            results.append(future.result());
+        futureInterface->reportResult(results);
+        futureInterface->reportFinished();
+    };
+
+    for (const QFuture<T> &future : futures) {
+        QFutureWatcher<T> *watcher = new QFutureWatcher<T>();
+        QObject::connect(watcher, &QFutureWatcher<T>::finished, [watcher, remaining, finish]() {
+            watcher->deleteLater();
+            if (--(*remaining) == 0)
+                finish();
+        });
+        watcher->setFuture(future);
+    }
+    return futureInterface->future();
+}
+
+#endif // PUSHBULLETFUTURE_H
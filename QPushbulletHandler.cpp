@@ -1,148 +1,623 @@
 #include "QPushbulletHandler.h"
+#include "QPushbulletTraceRecorder.h"
+#include "QPushbulletLogging.h"
+#include "QPushbulletFileCache.h"
 #include <QDebug>
 #include <iostream>
+#include <algorithm>
+#include <openssl/crypto.h>
 
-QPushbulletHandler::QPushbulletHandler(QString apiKey)
-    : m_NetworkManager()
-    , m_WebSocket()
-    , m_URLContacts("https://api.pushbullet.com/v2/contacts")
-    , m_URLDevices("https://api.pushbullet.com/v2/devices")
-    , m_URLMe("https://api.pushbullet.com/v2/users/me")
-    , m_URLPushes("https://api.pushbullet.com/v2/pushes")
-    , m_URLUploadRequest("https://api.pushbullet.com/v2/upload-request")
+//QNetworkAccessManager closes idle connections after two minutes
+static const qint64 IDLE_CONNECTION_TIMEOUT = 120000;
+
+//One pool for all handlers, so a QPushbulletPool with many encrypted accounts doesn't start a pool for each
+Q_GLOBAL_STATIC(QThreadPool, s_CryptoPool)
+
+//Tasks can outlive their handler on a shared pool. The handler is cleared under the mutex when it's destroyed, so a
+//result is either posted before that or dropped.
+struct QPushbulletCryptoTarget {
+    QMutex mutex;
+    QObject *handler;
+};
+
+namespace {
+
+//Stretches the password on a worker thread, the main thread only gets the finished key
+class KeyDerivationTask : public QRunnable
+{
+public:
+    KeyDerivationTask(std::shared_ptr<QPushbulletCryptoTarget> target, int generation, const QByteArray &password,
+                      const QByteArray &userID)
+        : m_Target(target), m_Generation(generation), m_Password(password), m_UserID(userID)
+    {
+    }
+
+    ~KeyDerivationTask()
+    {
+        OPENSSL_cleanse(m_Password.data(), m_Password.size());
+    }
+
+    void run() override
+    {
+        QPushbulletCryptoPointer crypto(new QPushbulletCrypto(m_Password, m_UserID));
+        QMutexLocker locker(&m_Target->mutex);
+        if (m_Target->handler) {
+            QMetaObject::invokeMethod(m_Target->handler, "handleKeyDerived", Qt::QueuedConnection,
+                                      Q_ARG(int, m_Generation), Q_ARG(QPushbulletCryptoPointer, crypto));
+        }
+    }
+
+private:
+    std::shared_ptr<QPushbulletCryptoTarget> m_Target;
+    int m_Generation;
+    QByteArray m_Password, m_UserID;
+};
+
+class DecryptionTask : public QRunnable
+{
+public:
+    DecryptionTask(std::shared_ptr<QPushbulletCryptoTarget> target, QPushbulletCryptoPointer crypto, quint64 sequence,
+                   const QByteArray &ciphertext)
+        : m_Target(target), m_Crypto(crypto), m_Sequence(sequence), m_Ciphertext(ciphertext)
+    {
+    }
+
+    void run() override
+    {
+        bool ok = false;
+        const QByteArray plaintext = m_Crypto->decrypt(m_Ciphertext, &ok);
+        QMutexLocker locker(&m_Target->mutex);
+        if (m_Target->handler) {
+            QMetaObject::invokeMethod(m_Target->handler, "handleDecryptedMessage", Qt::QueuedConnection,
+                                      Q_ARG(quint64, m_Sequence), Q_ARG(QByteArray, ok ? plaintext : QByteArray()));
+        }
+    }
+
+private:
+    std::shared_ptr<QPushbulletCryptoTarget> m_Target;
+    QPushbulletCryptoPointer m_Crypto;
+    quint64 m_Sequence;
+    QByteArray m_Ciphertext;
+};
+
+//The encrypted fields replace the ciphertext. Without the key the push is kept with what's in the clear.
+void decryptPushes(QJsonArray &pushes, const QPushbulletCryptoPointer &crypto)
+{
+    for (int i = 0; i < pushes.count(); i++) {
+        QJsonObject push = pushes.at(i).toObject();
+        if (!push["encrypted"].toBool())
+            continue;
+
+        bool ok = false;
+        const QByteArray plaintext = crypto->decrypt(push["ciphertext"].toString().toLatin1(), &ok);
+        if (!ok)
+            continue;
+        const QJsonObject decrypted = QJsonDocument::fromJson(plaintext).object();
+        for (auto it = decrypted.begin(); it != decrypted.end(); ++it)
+            push[it.key()] = it.value();
+        push.remove("ciphertext");
+        pushes[i] = push;
+    }
+}
+
+//Parses a push history reply and decrypts its encrypted pushes, so a large encrypted sync doesn't block the event loop
+class HistoryDecryptionTask : public QRunnable
+{
+public:
+    HistoryDecryptionTask(std::shared_ptr<QPushbulletCryptoTarget> target, QPushbulletCryptoPointer crypto,
+                          quint64 sequence, const QByteArray &data)
+        : m_Target(target), m_Crypto(crypto), m_Sequence(sequence), m_Data(data)
+    {
+    }
+
+    void run() override
+    {
+        QJsonArray pushes = QJsonDocument::fromJson(m_Data).object()["pushes"].toArray();
+        if (m_Crypto)
+            decryptPushes(pushes, m_Crypto);
+        QMutexLocker locker(&m_Target->mutex);
+        if (m_Target->handler) {
+            QMetaObject::invokeMethod(m_Target->handler, "handleDecryptedHistory", Qt::QueuedConnection,
+                                      Q_ARG(quint64, m_Sequence), Q_ARG(QJsonArray, pushes));
+        }
+    }
+
+private:
+    std::shared_ptr<QPushbulletCryptoTarget> m_Target;
+    QPushbulletCryptoPointer m_Crypto;
+    quint64 m_Sequence;
+    QByteArray m_Data;
+};
+
+}
+
+QPushbulletHandler::QPushbulletHandler(QString apiKey, QNetworkAccessManager *networkManager)
+    : m_CurrentOperation(CURRENT_OPERATION::NONE)
+    , m_NetworkManager(networkManager ? networkManager : new QNetworkAccessManager(this))
+    , m_WebSocket(nullptr)
+    , m_URLStream("wss://stream.pushbullet.com/websocket/")
     , m_APIKey(apiKey)
     , m_NetworkAccessibility(QNetworkAccessManager::NetworkAccessibility::UnknownAccessibility)
+    , m_PrewarmEnabled(false)
+    , m_Http2Enabled(false)
+    , m_TlsSessionReuseEnabled(false)
+    , m_DevicesModifiedAfter(0)
+    , m_ContactsModifiedAfter(0)
+    , m_FullListInterval(60 * 60 * 1000)
+    , m_DeviceListSize(0)
+    , m_ContactListSize(0)
+    , m_MirrorIconsEnabled(false)
+    , m_EphemeralsInFlight(0)
+    , m_MaxEphemeralRequests(2)
+    , m_TraceRecorder(nullptr)
+    , m_OfflineMode(false)
+    , m_LastReply(nullptr)
+    , m_NextBulkID(1)
+    , m_BulkRequestsInFlight(0)
+    , m_MaxBulkRequests(4)
+    , m_KeyGeneration(0)
+    , m_StreamSequence(0)
+    , m_NextStreamSequence(0)
+    , m_HistorySequence(0)
+    , m_StreamBatchingEnabled(false)
+    , m_StreamQueueLimit(1000)
+    , m_StreamOverflowPolicy(STREAM_OVERFLOW_POLICY::COALESCE)
+    , m_FileCache(nullptr)
 {
-    //Connect the QNetworkAccessManager signals
-    connect(&m_NetworkManager, SIGNAL(finished(QNetworkReply *)), this, SLOT(handleNetworkData(QNetworkReply *)));
-    connect(&m_NetworkManager, SIGNAL(networkSessionConnected()), this, SLOT(sessionConnected()));
-    connect(&m_NetworkManager, SIGNAL(networkAccessibleChanged(QNetworkAccessManager::NetworkAccessibility)), this
+    qRegisterMetaType<QPushbulletCryptoPointer>("QPushbulletCryptoPointer");
+    m_CryptoPool = s_CryptoPool();
+    m_CryptoTarget = std::make_shared<QPushbulletCryptoTarget>();
+    m_CryptoTarget->handler = this;
+    setAPIBaseURL(QUrl("https://api.pushbullet.com/v2"));
+    m_Clock.start();
+    m_EphemeralTimer.setSingleShot(true);
+    m_EphemeralTimer.setInterval(100);
+    connect(&m_EphemeralTimer, SIGNAL(timeout()), this, SLOT(flushEphemerals()));
+    m_StreamBatchTimer.setSingleShot(true);
+    m_StreamBatchTimer.setInterval(0);
+    connect(&m_StreamBatchTimer, SIGNAL(timeout()), this, SLOT(flushStreamQueue()));
+
+    //Connect the QNetworkAccessManager signals. Replies are connected one by one in trackReply() because the manager
+    //may be shared with other handlers.
+    connect(m_NetworkManager, SIGNAL(networkSessionConnected()), this, SLOT(sessionConnected()));
+    connect(m_NetworkManager, SIGNAL(networkAccessibleChanged(QNetworkAccessManager::NetworkAccessibility)), this
             , SLOT(handleNetworkAccessibilityChange(QNetworkAccessManager::NetworkAccessibility)));
 }
 
-void QPushbulletHandler::getRequest(QUrl url)
+QPushbulletHandler::~QPushbulletHandler()
+{
+    //A shared manager would keep these as children until it's destroyed. Disconnected first, abort() emits finished.
+    for (QNetworkReply *reply : m_PendingReplies) {
+        reply->disconnect(this);
+        reply->abort();
+        reply->deleteLater();
+    }
+    m_PendingReplies.clear();
+
+    //Tasks still running on the pool drop their results from now on
+    {
+        QMutexLocker locker(&m_CryptoTarget->mutex);
+        m_CryptoTarget->handler = nullptr;
+    }
+    OPENSSL_cleanse(m_PendingPassword.data(), m_PendingPassword.size());
+
+    //Futures of requests that never finished would otherwise wait forever
+    PushbulletError error;
+    error.networkError = QNetworkReply::OperationCanceledError;
+    error.message = "The handler was destroyed";
+    for (const Resolver &resolver : m_Resolvers)
+        resolver(QVariant(), error);
+    m_Resolvers.clear();
+    for (const PendingHistory &pending : m_PendingHistories) {
+        if (pending.resolver)
+            pending.resolver(QVariant(), error);
+    }
+    m_PendingHistories.clear();
+}
+
+QNetworkReply *QPushbulletHandler::getRequest(QUrl url, const QByteArray &etag)
 {
-    qDebug() << "Get Request";
-    url.setUserName(m_APIKey);
-    m_NetworkManager.get(QNetworkRequest(url));
+    m_LastReply = nullptr;
+    qCDebug(lcPushbulletNetwork) << "GET" << url.path();
+    if (m_OfflineMode)
+        return nullptr;
+    m_Metrics.recordRequest(getOperationName(m_CurrentOperation), 0);
+    QNetworkRequest request = createAPIRequest(url);
+    if (!etag.isEmpty())
+        request.setRawHeader("If-None-Match", etag);
+    QNetworkReply *reply = m_NetworkManager->get(request);
+    trackReply(reply);
+    return reply;
 }
 
-void QPushbulletHandler::postRequest(QUrl url, const QByteArray &data)
+QNetworkReply *QPushbulletHandler::postRequest(QUrl url, const QByteArray &data)
 {
-    qDebug() << "Post Request: " << QString(data);
+    m_LastReply = nullptr;
+    //Only the size is logged, the body may contain the contents of a push
+    qCDebug(lcPushbulletNetwork) << "POST" << url.path() << data.size() << "bytes";
+    if (m_OfflineMode)
+        return nullptr;
+    m_Metrics.recordRequest(getOperationName(m_CurrentOperation), data.size());
     QNetworkRequest request(url);
     if (m_CurrentOperation == CURRENT_OPERATION::UPLOAD_FILE) {
         request.setRawHeader(QString("Content-Type").toUtf8(), QString("multipart/form-data; boundary=margin").toUtf8());
     }
     else {
-        url.setUserName(m_APIKey);
-        request.setUrl(url);
+        request = createAPIRequest(url);
         request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
     }
+
+    QNetworkReply *reply = nullptr;
     if (m_CurrentOperation == CURRENT_OPERATION::DELETE_CONTACT || m_CurrentOperation == CURRENT_OPERATION::DELETE_DEVICE
-        || m_CurrentOperation == CURRENT_OPERATION::DELETE_PUSH)
-        m_NetworkManager.deleteResource(QNetworkRequest(url));
+        || m_CurrentOperation == CURRENT_OPERATION::DELETE_PUSH
+        || m_CurrentOperation == CURRENT_OPERATION::BULK_PUSH_DELETE
+        || m_CurrentOperation == CURRENT_OPERATION::DELETE_ALL_PUSHES)
+        reply = m_NetworkManager->deleteResource(request);
     else
-        m_NetworkManager.post(request, data);
+        reply = m_NetworkManager->post(request, data);
+    trackReply(reply);
+    return reply;
+}
+
+QNetworkRequest QPushbulletHandler::createAPIRequest(QUrl url)
+{
+    QNetworkRequest request(url);
+    //The key is sent as a header instead of the URL user info so a shared QNetworkAccessManager doesn't mix up the
+    //cached credentials of different accounts
+    request.setRawHeader("Access-Token", m_APIKey.toUtf8());
+    //Accept-Encoding is left alone on purpose. Qt only asks for gzip/deflate and decodes the body itself when the
+    //header isn't set by us.
+    if (m_TlsSessionReuseEnabled || m_Http2Enabled)
+        request.setSslConfiguration(getSslConfiguration());
+#if QT_VERSION >= QT_VERSION_CHECK(5, 8, 0)
+    if (m_Http2Enabled)
+        request.setAttribute(QNetworkRequest::HTTP2AllowedAttribute, true);
+#endif
+    return request;
+}
+
+QSslConfiguration QPushbulletHandler::getSslConfiguration()
+{
+    QSslConfiguration config = QSslConfiguration::defaultConfiguration();
+    if (m_TlsSessionReuseEnabled) {
+        config.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+        if (!m_SessionTicket.isEmpty())
+            config.setSessionTicket(m_SessionTicket);
+    }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    if (m_Http2Enabled)
+        config.setAllowedNextProtocols({QSslConfiguration::ALPNProtocolHTTP2, QSslConfiguration::NextProtocolHttp1_1});
+#endif
+    return config;
+}
+
+void QPushbulletHandler::trackReply(QNetworkReply *reply)
+{
+    //Every reply remembers the operation it was sent for, so overlapping requests are parsed correctly
+    reply->setProperty("operation", static_cast<int>(m_CurrentOperation));
+    reply->setProperty("sentAt", m_Clock.nsecsElapsed());
+    reply->setProperty("warm", m_LastAPIReply.isValid() && !m_LastAPIReply.hasExpired(IDLE_CONNECTION_TIMEOUT));
+    m_LastReply = reply;
+    m_PendingReplies.insert(reply);
+    connect(reply, &QNetworkReply::metaDataChanged, this, [this, reply]() {
+        if (!reply->property("firstByteAt").isValid())
+            reply->setProperty("firstByteAt", m_Clock.nsecsElapsed());
+    });
+    connect(reply, &QNetworkReply::finished, this, [this, reply]() {
+        handleNetworkData(reply);
+    });
 }
 
 void QPushbulletHandler::handleNetworkData(QNetworkReply *networkReply)
 {
+    m_PendingReplies.remove(networkReply);
+    networkReply->deleteLater();
+    m_CurrentOperation = static_cast<CURRENT_OPERATION>(networkReply->property("operation").toInt());
+
+    const qint64 sentAt = networkReply->property("sentAt").toLongLong();
+    const qint64 finishedAt = m_Clock.nsecsElapsed();
+    RequestTiming timing;
+    timing.operation = m_CurrentOperation;
+    timing.warm = networkReply->property("warm").toBool();
+    timing.timeToFirstByte = (networkReply->property("firstByteAt").isValid()
+                              ? networkReply->property("firstByteAt").toLongLong() : finishedAt) - sentAt;
+    timing.timeToFirstByte /= 1000;
+    timing.totalTime = (finishedAt - sentAt) / 1000;
+    emit didMeasureRequestTiming(timing);
+
+    if (m_CurrentOperation == CURRENT_OPERATION::PUSH_EPHEMERAL) {
+        m_EphemeralsInFlight--;
+        if (!m_EphemeralQueue.isEmpty() && !m_EphemeralTimer.isActive())
+            QTimer::singleShot(0, this, SLOT(flushEphemerals()));
+    }
+
+    if (m_TlsSessionReuseEnabled) {
+        const QByteArray ticket = networkReply->sslConfiguration().sessionTicket();
+        if (!ticket.isEmpty() && ticket != m_SessionTicket) {
+            m_SessionTicket = ticket;
+            emit didReceiveTlsSessionTicket(m_SessionTicket);
+        }
+    }
+
+    if (networkReply->property("bulkID").isValid()) {
+        handleBulkReply(networkReply, timing.totalTime);
+        m_CurrentOperation = CURRENT_OPERATION::NONE;
+        emit didFinishRequest();
+        return;
+    }
+
     if (networkReply->error()) {
-        qDebug() << "Error String: " << networkReply->errorString();
+        qCWarning(lcPushbulletNetwork) << "Error String: " << networkReply->errorString();
         QByteArray response(networkReply->readAll());
-        qDebug() << QString(response);
+        qCDebug(lcPushbulletNetwork) << response;
+        m_Metrics.recordReply(getOperationName(m_CurrentOperation), true, response.size(), timing.totalTime);
+        //An HTTP error still came over an open connection, but a connection error may have closed it
+        if (networkReply->error() < QNetworkReply::ProxyConnectionRefusedError
+            && m_CurrentOperation != CURRENT_OPERATION::DOWNLOAD_FILE)
+            m_LastAPIReply.invalidate();
+        //Files are kept out of traces, failed fetches too
+        if (m_TraceRecorder && m_CurrentOperation != CURRENT_OPERATION::DOWNLOAD_FILE) {
+            m_TraceRecorder->recordError(static_cast<int>(m_CurrentOperation),
+                                         networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt(),
+                                         response);
+        }
+        //Without the iden there's no salt, so the password isn't kept around waiting for one
+        if (m_CurrentOperation == CURRENT_OPERATION::GET_USER && !m_PendingPassword.isEmpty()) {
+            qCWarning(lcPushbulletStream) << "Couldn't fetch the user iden, encryption is off";
+            OPENSSL_cleanse(m_PendingPassword.data(), m_PendingPassword.size());
+            m_PendingPassword.clear();
+            emit didFailEncryption();
+        }
+        //A failed delta leaves the sync point in doubt, so the next fetch is a full one
+        if (m_CurrentOperation == CURRENT_OPERATION::UPDATE_DEVICE_LIST)
+            m_DevicesRevalidated.invalidate();
+        else if (m_CurrentOperation == CURRENT_OPERATION::UPDATE_CONTACT_LIST)
+            m_ContactsRevalidated.invalidate();
         emit didReceiveError(networkReply);
+        if (m_Resolvers.contains(networkReply)) {
+            PushbulletError error;
+            error.networkError = networkReply->error();
+            error.httpStatus = networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+            error.message = networkReply->errorString();
+            error.response = response;
+            m_Resolvers.take(networkReply)(QVariant(), error);
+        }
+        m_CurrentOperation = CURRENT_OPERATION::NONE;
+        emit didFinishRequest();
         return;
     }
 
+    //Files come from another host, they don't keep the API connection open
+    if (m_CurrentOperation != CURRENT_OPERATION::DOWNLOAD_FILE)
+        m_LastAPIReply.start();
     QByteArray response(networkReply->readAll());
-    if (m_CurrentOperation == CURRENT_OPERATION::GET_DEVICE_LIST) {
+    const TransferStats stats = getTransferStats(networkReply, response);
+    emit didMeasureTransfer(stats);
+    m_Metrics.recordReply(getOperationName(m_CurrentOperation), false, stats.bytes, timing.totalTime);
+
+    if (m_CurrentOperation == CURRENT_OPERATION::DOWNLOAD_FILE) {
+        //The URL is needed for the cache and the signal, and files are kept out of traces
+        const QString url = networkReply->property("fileURL").toString();
+        if (m_FileCache)
+            m_FileCache->put(url, response);
+        emit didDownloadFile(url, response);
+        m_CurrentOperation = CURRENT_OPERATION::NONE;
+        emit didFinishRequest();
+        return;
+    }
+
+    const QByteArray etag = networkReply->rawHeader("ETag");
+    if (m_TraceRecorder) {
+        m_TraceRecorder->recordReply(static_cast<int>(m_CurrentOperation),
+                                     networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt(), etag,
+                                     response);
+    }
+
+    const bool isHistory = m_CurrentOperation == CURRENT_OPERATION::GET_PUSH_HISTORY
+                           || m_CurrentOperation == CURRENT_OPERATION::UPDATE_PUSH_LIST;
+    //Encrypted histories are decrypted on the pool. Plain ones queue behind them while any is pending, to keep order.
+    if (isHistory && ((m_Crypto && response.contains("\"encrypted\"")) || !m_PendingHistories.isEmpty())) {
+        PendingHistory pending;
+        pending.operation = m_CurrentOperation;
+        pending.resolver = m_Resolvers.take(networkReply);
+        m_PendingHistories.insert(m_HistorySequence, pending);
+        m_CryptoPool->start(new HistoryDecryptionTask(m_CryptoTarget, m_Crypto, m_HistorySequence++, response));
+        m_CurrentOperation = CURRENT_OPERATION::NONE;
+        emit didFinishRequest();
+        return;
+    }
+
+    QElapsedTimer parseTimer;
+    parseTimer.start();
+    const QVariant result = processResponse(response, stats.notModified, etag);
+    m_Metrics.recordParse(getOperationName(m_CurrentOperation), parseTimer.nsecsElapsed() / 1000);
+    if (m_Resolvers.contains(networkReply))
+        m_Resolvers.take(networkReply)(result, PushbulletError());
+
+    m_CurrentOperation = CURRENT_OPERATION::NONE;
+    emit didFinishRequest();
+}
+
+QVariant QPushbulletHandler::processResponse(const QByteArray &response, bool notModified, const QByteArray &etag)
+{
+    QVariant result;
+    if (notModified) {
+        //Nothing changed since the last full list, so the local one is given back without parsing
+        if (m_CurrentOperation == CURRENT_OPERATION::GET_DEVICE_LIST) {
+            m_DevicesRevalidated.start();
+            emit didReceiveDevices(m_Devices);
+            result = QVariant::fromValue(m_Devices);
+        }
+        else if (m_CurrentOperation == CURRENT_OPERATION::GET_CONTACT_LIST) {
+            m_ContactsRevalidated.start();
+            emit didReceiveContacts(m_Contacts);
+            result = QVariant::fromValue(m_Contacts);
+        }
+    }
+    else if (m_CurrentOperation == CURRENT_OPERATION::GET_DEVICE_LIST) {
+        m_DevicesETag = etag;
+        m_DevicesRevalidated.start();
+        m_DeviceListSize = response.size();
+        parseDeviceResponse(response);
+        result = QVariant::fromValue(m_Devices);
+    }
+    else if (m_CurrentOperation == CURRENT_OPERATION::UPDATE_DEVICE_LIST) {
         parseDeviceResponse(response);
+        result = QVariant::fromValue(m_Devices);
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::CREATE_DEVICE) {
-        parseCreateDeviceResponse(response);
+        result = QVariant::fromValue(parseCreateDeviceResponse(response));
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::DELETE_DEVICE) {
         emit didDeviceDelete();
+        result = true;
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::UPDATE_DEVICE) {
-        parseUpdateDeviceResponce(response);
+        result = QVariant::fromValue(parseUpdateDeviceResponce(response));
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::GET_CONTACT_LIST) {
+        m_ContactsETag = etag;
+        m_ContactsRevalidated.start();
+        m_ContactListSize = response.size();
         parseContactResponse(response);
+        result = QVariant::fromValue(m_Contacts);
+    }
+    else if (m_CurrentOperation == CURRENT_OPERATION::UPDATE_CONTACT_LIST) {
+        parseContactResponse(response);
+        result = QVariant::fromValue(m_Contacts);
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::CREATE_CONTACT) {
-        parseCreateContactResponse(response);
+        result = QVariant::fromValue(parseCreateContactResponse(response));
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::UPDATE_CONTACT) {
-        parseUpdateContactResponse(response);
+        result = QVariant::fromValue(parseUpdateContactResponse(response));
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::DELETE_CONTACT) {
         emit didContactDelete();
+        result = true;
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::GET_PUSH_HISTORY) {
         parsePushHistoryResponse(response);
+        result = QVariant::fromValue(m_Pushes);
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::PUSH) {
-        parsePushResponse(response);
+        result = QVariant::fromValue(parsePushResponse(response));
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::PUSH_UPDATE) {
-        parsePushResponse(response);
+        result = QVariant::fromValue(parsePushResponse(response));
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::UPDATE_PUSH_LIST) {
         parsePushHistoryResponse(response);
+        result = QVariant::fromValue(m_Pushes);
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::DELETE_PUSH) {
         emit didPushDelete();
+        result = true;
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::REQUEST_UPLOAD_FILE) {
         parseUploadRequestResponse(response);
     }
     else if (m_CurrentOperation == CURRENT_OPERATION::UPLOAD_FILE) {
-        QString str(response);
-        qDebug() << str;
+        qCDebug(lcPushbulletNetwork) << response;
+    }
+    else if (m_CurrentOperation == CURRENT_OPERATION::PUSH_EPHEMERAL) {
+        emit didPushEphemeral();
+        result = true;
     }
+    else if (m_CurrentOperation == CURRENT_OPERATION::GET_USER) {
+        m_UserID = QJsonDocument::fromJson(response).object()["iden"].toString();
+        const bool failed = !m_PendingPassword.isEmpty() && m_UserID.isEmpty();
+        if (!m_PendingPassword.isEmpty() && !m_UserID.isEmpty())
+            startKeyDerivation(m_PendingPassword);
+        OPENSSL_cleanse(m_PendingPassword.data(), m_PendingPassword.size());
+        m_PendingPassword.clear();
+        if (failed) {
+            qCWarning(lcPushbulletStream) << "The user has no iden, encryption is off";
+            emit didFailEncryption();
+        }
+        result = m_UserID;
+    }
+    return result;
+}
 
-    m_CurrentOperation = CURRENT_OPERATION::NONE;
+QPushbulletHandler::TransferStats QPushbulletHandler::getTransferStats(QNetworkReply *networkReply,
+                                                                        const QByteArray &response)
+{
+    TransferStats stats;
+    stats.operation = m_CurrentOperation;
+    stats.notModified = networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 304;
+    stats.bytes = response.size();
+
+    //Deltas and 304s are compared to the last full list, everything else saved nothing
+    qint64 fullSize = stats.bytes;
+    if (m_CurrentOperation == CURRENT_OPERATION::UPDATE_DEVICE_LIST
+        || (stats.notModified && m_CurrentOperation == CURRENT_OPERATION::GET_DEVICE_LIST))
+        fullSize = qMax(fullSize, m_DeviceListSize);
+    else if (m_CurrentOperation == CURRENT_OPERATION::UPDATE_CONTACT_LIST
+             || (stats.notModified && m_CurrentOperation == CURRENT_OPERATION::GET_CONTACT_LIST))
+        fullSize = qMax(fullSize, m_ContactListSize);
+    stats.bytesSaved = qMax(Q_INT64_C(0), fullSize - stats.bytes);
+    return stats;
 }
 
 void QPushbulletHandler::sessionConnected()
 {
-    qDebug() << "Connected";
+    qCDebug(lcPushbulletNetwork) << "Connected";
 }
 
 void QPushbulletHandler::handleNetworkAccessibilityChange(QNetworkAccessManager::NetworkAccessibility change)
 {
     m_NetworkAccessibility = change;
     if (m_NetworkAccessibility == QNetworkAccessManager::UnknownAccessibility)
-        qDebug() << "Unknown network accessibility";
-    else if (m_NetworkAccessibility == QNetworkAccessManager::Accessible)
-        qDebug() << "Network is accessible";
-    else if (m_NetworkAccessibility == QNetworkAccessManager::NotAccessible)
-        qDebug() << "Network is not accessible";
+        qCDebug(lcPushbulletNetwork) << "Unknown network accessibility";
+    else if (m_NetworkAccessibility == QNetworkAccessManager::Accessible) {
+        qCDebug(lcPushbulletNetwork) << "Network is accessible";
+        if (m_PrewarmEnabled)
+            prewarmConnection();
+    }
+    else if (m_NetworkAccessibility == QNetworkAccessManager::NotAccessible) {
+        qCDebug(lcPushbulletNetwork) << "Network is not accessible";
+        m_LastAPIReply.invalidate();
+    }
 }
 
 void QPushbulletHandler::webSocketConnected()
 {
-    qDebug() << "Web Socket Connected";
-    connect(&m_WebSocket, SIGNAL(textMessageReceived(QString)), this, SLOT(textMessageReceived(QString)));
+    qCDebug(lcPushbulletStream) << "Web Socket Connected";
+    m_Metrics.recordWebSocketConnect();
 }
 
 void QPushbulletHandler::webSocketDisconnected()
 {
-    qDebug() << "Web Socket Disconnected";
+    qCDebug(lcPushbulletStream) << "Web Socket Disconnected";
 }
 
 void QPushbulletHandler::textMessageReceived(QString message)
 {
+    if (m_TraceRecorder)
+        m_TraceRecorder->recordStreamMessage(message);
+
+    QElapsedTimer parseTimer;
+    parseTimer.start();
     parseMirrorPush(message);
+    m_Metrics.recordStreamMessage(message.size(), parseTimer.nsecsElapsed() / 1000);
 }
 
 void QPushbulletHandler::requestDeviceList()
 {
-    m_CurrentOperation = CURRENT_OPERATION::GET_DEVICE_LIST;
-    getRequest(m_URLDevices);
+    if (m_Devices.isEmpty() || m_DevicesModifiedAfter <= 0 || !m_DevicesRevalidated.isValid()
+        || m_DevicesRevalidated.elapsed() >= m_FullListInterval) {
+        m_CurrentOperation = CURRENT_OPERATION::GET_DEVICE_LIST;
+        getRequest(m_URLDevices, m_Devices.isEmpty() ? QByteArray() : m_DevicesETag);
+    }
+    else {
+        m_CurrentOperation = CURRENT_OPERATION::UPDATE_DEVICE_LIST;
+        QUrlQuery query;
+        query.addQueryItem("modified_after", QString::number(m_DevicesModifiedAfter, 'f', 6));
+        QUrl modifiedURL = m_URLDevices;
+        modifiedURL.setQuery(query);
+        getRequest(modifiedURL);
+    }
 }
 
 void QPushbulletHandler::requestCreateDevice(QString deviceName, QString model)
@@ -186,8 +661,24 @@ void QPushbulletHandler::requestDeviceDelete(QString deviceID)
 
 void QPushbulletHandler::requestContactList()
 {
-    m_CurrentOperation = CURRENT_OPERATION::GET_CONTACT_LIST;
-    getRequest(m_URLContacts);
+    if (m_Contacts.isEmpty() || m_ContactsModifiedAfter <= 0 || !m_ContactsRevalidated.isValid()
+        || m_ContactsRevalidated.elapsed() >= m_FullListInterval) {
+        m_CurrentOperation = CURRENT_OPERATION::GET_CONTACT_LIST;
+        getRequest(m_URLContacts, m_Contacts.isEmpty() ? QByteArray() : m_ContactsETag);
+    }
+    else {
+        m_CurrentOperation = CURRENT_OPERATION::UPDATE_CONTACT_LIST;
+        QUrlQuery query;
+        query.addQueryItem("modified_after", QString::number(m_ContactsModifiedAfter, 'f', 6));
+        QUrl modifiedURL = m_URLContacts;
+        modifiedURL.setQuery(query);
+        getRequest(modifiedURL);
+    }
+}
+
+void QPushbulletHandler::setFullListInterval(qint64 msecs)
+{
+    m_FullListInterval = msecs;
 }
 
 void QPushbulletHandler::requestCreateContact(QString name, QString email)
@@ -296,7 +787,6 @@ void QPushbulletHandler::requestPush(Push &push, QString deviceID, QString email
     m_CurrentOperation = CURRENT_OPERATION::PUSH;
 
     jsonDocument.setObject(jsonObject);
-    qDebug() << QString(jsonDocument.toJson());
     postRequest(m_URLPushes, jsonDocument.toJson());
 }
 
@@ -317,14 +807,14 @@ void QPushbulletHandler::requestPushToAllDevices(Push &push)
 
 void QPushbulletHandler::requestPushUpdate(QString pushID, bool dismissed)
 {
-    QUrlQuery query;
-    query.addQueryItem("dismissed", dismissed ? "true" : "false");
+    QJsonObject jsonObject;
+    jsonObject["dismissed"] = dismissed;
     QString url = m_URLPushes.toString();
     url.append("/");
     url.append(pushID);
     QUrl modifiedURL(url);
     m_CurrentOperation = CURRENT_OPERATION::PUSH_UPDATE;
-    postRequest(modifiedURL, query.toString(QUrl::FullyEncoded).toUtf8());
+    postRequest(modifiedURL, QJsonDocument(jsonObject).toJson(QJsonDocument::Compact));
 }
 
 void QPushbulletHandler::requestPushDelete(QString pushID)
@@ -341,23 +831,550 @@ void QPushbulletHandler::requestPushDelete(QString pushID)
     postRequest(modifiedURL, query.toString(QUrl::FullyEncoded).toUtf8());
 }
 
+int QPushbulletHandler::requestPushesDismissal(QStringList pushIDs)
+{
+    return startBulkOperation(pushIDs, true);
+}
+
+int QPushbulletHandler::requestPushesDismissal(PushPredicate predicate)
+{
+    QStringList pushIDs;
+    for (const Push &push : m_Pushes) {
+        if (predicate(push))
+            pushIDs.append(push.ID);
+    }
+    return startBulkOperation(pushIDs, true);
+}
+
+int QPushbulletHandler::requestPushesDelete(QStringList pushIDs)
+{
+    return startBulkOperation(pushIDs, false);
+}
+
+int QPushbulletHandler::requestPushesDelete(PushPredicate predicate)
+{
+    QStringList pushIDs;
+    for (const Push &push : m_Pushes) {
+        if (predicate(push))
+            pushIDs.append(push.ID);
+    }
+    return startBulkOperation(pushIDs, false);
+}
+
+int QPushbulletHandler::requestDeleteAllPushes()
+{
+    const int bulkID = m_NextBulkID++;
+    BulkOperation &bulk = m_BulkOperations[bulkID];
+    bulk.dismiss = false;
+    for (const Push &push : m_Pushes)
+        bulk.originals.insert(push.ID, push);
+    //An empty ID in the queue stands for the whole history
+    bulk.queue.append(QString());
+
+    m_Pushes.clear();
+    emit didReceivePushHistory(m_Pushes);
+    QTimer::singleShot(0, this, SLOT(flushBulkOperations()));
+    return bulkID;
+}
+
+void QPushbulletHandler::setMaxBulkRequests(int count)
+{
+    m_MaxBulkRequests = qMax(1, count);
+}
+
+int QPushbulletHandler::startBulkOperation(QStringList pushIDs, bool dismiss)
+{
+    pushIDs.removeDuplicates();
+    const int bulkID = m_NextBulkID++;
+    BulkOperation &bulk = m_BulkOperations[bulkID];
+    bulk.dismiss = dismiss;
+
+    QSet<QString> remaining;
+    remaining.reserve(pushIDs.count());
+    for (const QString &pushID : pushIDs)
+        remaining.insert(pushID);
+    for (Push &push : m_Pushes) {
+        if (!remaining.contains(push.ID))
+            continue;
+        if (dismiss && push.dismissed) {
+            //Already dismissed, so there's nothing to send
+            remaining.remove(push.ID);
+            finishBulkItem(bulk, push.ID, true, 0, QString());
+            continue;
+        }
+
+        bulk.originals.insert(push.ID, push);
+        if (dismiss)
+            push.dismissed = true;
+    }
+    //Removed in one pass, histories can be too large to remove pushes one by one
+    if (!dismiss && !bulk.originals.isEmpty()) {
+        m_Pushes.erase(std::remove_if(m_Pushes.begin(), m_Pushes.end(), [&bulk](const Push & push) {
+            return bulk.originals.contains(push.ID);
+        }), m_Pushes.end());
+    }
+
+    for (const QString &pushID : pushIDs) {
+        if (remaining.contains(pushID))
+            bulk.queue.append(pushID);
+    }
+
+    if (!bulk.originals.isEmpty())
+        emit didReceivePushHistory(m_Pushes);
+    //Sent from the event loop, so the caller has the ID before didFinishBulkOperation can be emitted
+    QTimer::singleShot(0, this, SLOT(flushBulkOperations()));
+    return bulkID;
+}
+
+void QPushbulletHandler::flushBulkOperations()
+{
+    QMap<int, BulkResultList> finished;
+    for (auto it = m_BulkOperations.begin(); it != m_BulkOperations.end();) {
+        BulkOperation &bulk = it.value();
+        while (!bulk.queue.isEmpty() && m_BulkRequestsInFlight < m_MaxBulkRequests) {
+            const QString pushID = bulk.queue.takeFirst();
+            QNetworkReply *reply = nullptr;
+            if (pushID.isEmpty()) {
+                m_CurrentOperation = CURRENT_OPERATION::DELETE_ALL_PUSHES;
+                reply = postRequest(m_URLPushes, QByteArray());
+            }
+            else {
+                QUrl url(m_URLPushes.toString() + "/" + pushID);
+                if (bulk.dismiss) {
+                    QJsonObject jsonObject;
+                    jsonObject["dismissed"] = true;
+                    m_CurrentOperation = CURRENT_OPERATION::BULK_PUSH_UPDATE;
+                    reply = postRequest(url, QJsonDocument(jsonObject).toJson(QJsonDocument::Compact));
+                }
+                else {
+                    m_CurrentOperation = CURRENT_OPERATION::BULK_PUSH_DELETE;
+                    reply = postRequest(url, QByteArray());
+                }
+            }
+            m_CurrentOperation = CURRENT_OPERATION::NONE;
+
+            if (!reply) {
+                if (pushID.isEmpty()) {
+                    finishBulkItem(bulk, QString(), false, 0, "The request was not sent");
+                    for (const QString &id : bulk.originals.keys())
+                        finishBulkItem(bulk, id, false, 0, "The request was not sent");
+                }
+                else {
+                    finishBulkItem(bulk, pushID, false, 0, "The request was not sent");
+                }
+                continue;
+            }
+            reply->setProperty("bulkID", it.key());
+            reply->setProperty("pushID", pushID);
+            bulk.inFlight++;
+            m_BulkRequestsInFlight++;
+        }
+        if (!bulk.failed.isEmpty()) {
+            restoreFailedPushes(bulk);
+            emit didReceivePushHistory(m_Pushes);
+        }
+
+        if (bulk.queue.isEmpty() && bulk.inFlight == 0) {
+            finished.insert(it.key(), bulk.results);
+            it = m_BulkOperations.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    for (auto it = finished.constBegin(); it != finished.constEnd(); ++it)
+        emit didFinishBulkOperation(it.key(), it.value());
+}
+
+void QPushbulletHandler::handleBulkReply(QNetworkReply *networkReply, qint64 latency)
+{
+    m_BulkRequestsInFlight--;
+    const QByteArray response(networkReply->readAll());
+    const int httpStatus = networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    //Deleting a push that is already gone leaves it in the state that was asked for
+    const bool ok = !networkReply->error()
+                    || (m_CurrentOperation == CURRENT_OPERATION::BULK_PUSH_DELETE && httpStatus == 404);
+    m_Metrics.recordReply(getOperationName(m_CurrentOperation), !ok, response.size(), latency);
+    if (!ok) {
+        qCWarning(lcPushbulletNetwork) << "Error String: " << networkReply->errorString();
+        emit didReceiveError(networkReply);
+    }
+
+    auto it = m_BulkOperations.find(networkReply->property("bulkID").toInt());
+    if (it == m_BulkOperations.end())
+        return;
+
+    BulkOperation &bulk = it.value();
+    bulk.inFlight--;
+    const QString pushID = networkReply->property("pushID").toString();
+    const QString error = ok ? QString() : networkReply->errorString();
+    if (pushID.isEmpty()) {
+        //The delete-all request gets a result of its own, the local list may have been empty
+        finishBulkItem(bulk, QString(), ok, httpStatus, error);
+        for (const QString &id : bulk.originals.keys())
+            finishBulkItem(bulk, id, ok, httpStatus, error);
+    }
+    else {
+        finishBulkItem(bulk, pushID, ok, httpStatus, error);
+    }
+
+    if (!bulk.failed.isEmpty()) {
+        restoreFailedPushes(bulk);
+        emit didReceivePushHistory(m_Pushes);
+    }
+    flushBulkOperations();
+}
+
+void QPushbulletHandler::finishBulkItem(BulkOperation &bulk, const QString &pushID, bool ok, int httpStatus,
+                                        const QString &error)
+{
+    BulkItemResult result;
+    result.pushID = pushID;
+    result.ok = ok;
+    result.httpStatus = httpStatus;
+    result.error = error;
+    bulk.results.append(result);
+
+    auto originalIt = bulk.originals.constFind(pushID);
+    if (!ok && originalIt != bulk.originals.constEnd())
+        bulk.failed.append(originalIt.value());
+}
+
+void QPushbulletHandler::restoreFailedPushes(BulkOperation &bulk)
+{
+    //Done in one pass over the history for all failed items, a failed delete-all restores the whole history
+    QHash<QString, Push> missing;
+    missing.reserve(bulk.failed.count());
+    for (const Push &push : bulk.failed)
+        missing.insert(push.ID, push);
+    bulk.failed.clear();
+
+    //Dismissed pushes are still in the list and are changed back in place
+    for (Push &push : m_Pushes) {
+        auto foundIt = missing.find(push.ID);
+        if (foundIt != missing.end()) {
+            push = foundIt.value();
+            missing.erase(foundIt);
+        }
+    }
+    if (missing.isEmpty())
+        return;
+
+    //Deleted pushes are merged back, the history is sorted newest first
+    auto newerFirst = [](const Push & a, const Push & b) {
+        return a.modified > b.modified;
+    };
+    PushList restored = missing.values();
+    std::sort(restored.begin(), restored.end(), newerFirst);
+    PushList merged;
+    merged.reserve(m_Pushes.count() + restored.count());
+    std::merge(m_Pushes.constBegin(), m_Pushes.constEnd(), restored.constBegin(), restored.constEnd(),
+               std::back_inserter(merged), newerFirst);
+    m_Pushes.swap(merged);
+}
+
+void QPushbulletHandler::attachResolver(Resolver resolver)
+{
+    //m_LastReply is the reply of the request that was just made, or nullptr if nothing was sent
+    if (!m_LastReply) {
+        PushbulletError error;
+        error.networkError = QNetworkReply::OperationCanceledError;
+        error.message = "The request was not sent";
+        resolver(QVariant(), error);
+        return;
+    }
+
+    m_Resolvers.insert(m_LastReply, resolver);
+    connect(m_LastReply, &QObject::destroyed, this, [this](QObject *reply) {
+        m_Resolvers.remove(static_cast<QNetworkReply *>(reply));
+    });
+    m_LastReply = nullptr;
+}
+
+QFuture<PushbulletResult<DeviceList>> QPushbulletHandler::requestDeviceListAsync()
+{
+    requestDeviceList();
+    return createFuture<DeviceList>();
+}
+
+QFuture<PushbulletResult<Device>> QPushbulletHandler::requestCreateDeviceAsync(QString deviceName, QString model)
+{
+    requestCreateDevice(deviceName, model);
+    return createFuture<Device>();
+}
+
+QFuture<PushbulletResult<Device>> QPushbulletHandler::requestDeviceUpdateAsync(QString deviceID, QString newNickname)
+{
+    requestDeviceUpdate(deviceID, newNickname);
+    return createFuture<Device>();
+}
+
+QFuture<PushbulletResult<bool>> QPushbulletHandler::requestDeviceDeleteAsync(QString deviceID)
+{
+    requestDeviceDelete(deviceID);
+    return createFuture<bool>();
+}
+
+QFuture<PushbulletResult<ContactList>> QPushbulletHandler::requestContactListAsync()
+{
+    requestContactList();
+    return createFuture<ContactList>();
+}
+
+QFuture<PushbulletResult<Contact>> QPushbulletHandler::requestCreateContactAsync(QString name, QString email)
+{
+    requestCreateContact(name, email);
+    return createFuture<Contact>();
+}
+
+QFuture<PushbulletResult<Contact>> QPushbulletHandler::requestContactUpdateAsync(QString contactID, QString newName)
+{
+    requestContactUpdate(contactID, newName);
+    return createFuture<Contact>();
+}
+
+QFuture<PushbulletResult<bool>> QPushbulletHandler::requestContactDeleteAsync(QString contactID)
+{
+    requestContactDelete(contactID);
+    return createFuture<bool>();
+}
+
+QFuture<PushbulletResult<PushList>> QPushbulletHandler::requestPushHistoryAsync()
+{
+    requestPushHistory();
+    return createFuture<PushList>();
+}
+
+QFuture<PushbulletResult<PushList>> QPushbulletHandler::requestPushHistoryAsync(double modifiedAfter)
+{
+    requestPushHistory(modifiedAfter);
+    return createFuture<PushList>();
+}
+
+QFuture<PushbulletResult<Push>> QPushbulletHandler::requestPushToDeviceAsync(Push push, QString deviceID)
+{
+    requestPushToDevice(push, deviceID);
+    return createFuture<Push>();
+}
+
+QFuture<PushbulletResult<Push>> QPushbulletHandler::requestPushToContactAsync(Push push, QString email)
+{
+    requestPushToContact(push, email);
+    return createFuture<Push>();
+}
+
+QFuture<PushbulletResult<Push>> QPushbulletHandler::requestPushToAllDevicesAsync(Push push)
+{
+    requestPushToAllDevices(push);
+    return createFuture<Push>();
+}
+
+QFuture<PushbulletResult<Push>> QPushbulletHandler::requestPushUpdateAsync(QString pushID, bool dismissed)
+{
+    requestPushUpdate(pushID, dismissed);
+    return createFuture<Push>();
+}
+
+QFuture<PushbulletResult<bool>> QPushbulletHandler::requestPushDeleteAsync(QString pushID)
+{
+    requestPushDelete(pushID);
+    return createFuture<bool>();
+}
+
+void QPushbulletHandler::requestEphemeral(const QJsonObject &push)
+{
+    if (push["type"] == "dismissal") {
+        //Only the last dismissal of a notification matters
+        auto foundIt = std::find_if(m_EphemeralQueue.begin(), m_EphemeralQueue.end(), [&push](const QJsonObject & queued) {
+            return queued["type"] == "dismissal" && queued["package_name"] == push["package_name"]
+                   && queued["notification_id"] == push["notification_id"]
+                   && queued["notification_tag"] == push["notification_tag"];
+        });
+        if (foundIt != m_EphemeralQueue.end()) {
+            *foundIt = push;
+            return;
+        }
+    }
+
+    m_EphemeralQueue.append(push);
+    if (!m_EphemeralTimer.isActive())
+        m_EphemeralTimer.start();
+}
+
+void QPushbulletHandler::requestEphemeralDismissal(const MirrorPush &mirror)
+{
+    QJsonObject push;
+    push["type"] = "dismissal";
+    push["package_name"] = mirror.packageName;
+    push["notification_id"] = mirror.notificationID;
+    push["notification_tag"] = mirror.notificationTag.isEmpty() ? QJsonValue() : QJsonValue(mirror.notificationTag);
+    push["source_user_iden"] = mirror.sourceUserID;
+    requestEphemeral(push);
+}
+
+void QPushbulletHandler::requestEphemeralReply(const MirrorPush &mirror, QString message)
+{
+    QJsonObject push;
+    push["type"] = "messaging_extension_reply";
+    push["package_name"] = mirror.packageName;
+    push["source_user_iden"] = mirror.sourceUserID;
+    push["target_device_iden"] = mirror.sourceDeviceID;
+    push["conversation_iden"] = mirror.conversationID;
+    push["message"] = message;
+    requestEphemeral(push);
+}
+
+void QPushbulletHandler::flushEphemerals()
+{
+    while (!m_EphemeralQueue.isEmpty() && m_EphemeralsInFlight < m_MaxEphemeralRequests) {
+        QJsonObject push = m_EphemeralQueue.takeFirst();
+        if (m_Crypto) {
+            //Encrypting one small ephemeral takes microseconds, so it isn't worth a trip to the pool
+            QJsonObject encrypted;
+            encrypted["encrypted"] = true;
+            const QByteArray plaintext = QJsonDocument(push).toJson(QJsonDocument::Compact);
+            encrypted["ciphertext"] = QString::fromLatin1(m_Crypto->encrypt(plaintext));
+            push = encrypted;
+        }
+
+        QJsonObject jsonObject;
+        jsonObject["type"] = "push";
+        jsonObject["push"] = push;
+
+        m_CurrentOperation = CURRENT_OPERATION::PUSH_EPHEMERAL;
+        m_EphemeralsInFlight++;
+        if (!postRequest(m_URLEphemerals, QJsonDocument(jsonObject).toJson(QJsonDocument::Compact)))
+            m_EphemeralsInFlight--;
+    }
+}
+
+void QPushbulletHandler::setEphemeralFlushInterval(int msecs)
+{
+    m_EphemeralTimer.setInterval(msecs);
+}
+
+void QPushbulletHandler::setMaxEphemeralRequests(int count)
+{
+    m_MaxEphemeralRequests = qMax(1, count);
+}
+
+void QPushbulletHandler::setMirrorIconsEnabled(bool enabled)
+{
+    m_MirrorIconsEnabled = enabled;
+}
+
+void QPushbulletHandler::setEncryptionPassword(QString password, QString userID)
+{
+    //A derivation that is still running for an older password is ignored when it finishes
+    m_KeyGeneration++;
+    m_Crypto.reset();
+    OPENSSL_cleanse(m_PendingPassword.data(), m_PendingPassword.size());
+    m_PendingPassword.clear();
+    if (password.isEmpty())
+        return;
+
+    if (!userID.isEmpty())
+        m_UserID = userID;
+    if (m_UserID.isEmpty()) {
+        m_PendingPassword = password.toUtf8();
+        m_CurrentOperation = CURRENT_OPERATION::GET_USER;
+        getRequest(m_URLMe);
+        return;
+    }
+    startKeyDerivation(password.toUtf8());
+}
+
+void QPushbulletHandler::startKeyDerivation(const QByteArray &password)
+{
+    m_CryptoPool->start(new KeyDerivationTask(m_CryptoTarget, m_KeyGeneration, password, m_UserID.toUtf8()));
+}
+
+void QPushbulletHandler::handleKeyDerived(int generation, QPushbulletCryptoPointer crypto)
+{
+    if (generation != m_KeyGeneration)
+        return;
+    if (!crypto->hasKey()) {
+        qCWarning(lcPushbulletStream) << "Couldn't derive the encryption key";
+        emit didFailEncryption();
+        return;
+    }
+    m_Crypto = crypto;
+    emit didEnableEncryption();
+}
+
+bool QPushbulletHandler::isEncryptionEnabled() const
+{
+    return m_Crypto != nullptr;
+}
+
+void QPushbulletHandler::setStreamBatchingEnabled(bool enabled)
+{
+    if (!enabled)
+        flushStreamQueue();
+    m_StreamBatchingEnabled = enabled;
+}
+
+void QPushbulletHandler::setStreamBatchInterval(int msecs)
+{
+    m_StreamBatchTimer.setInterval(qMax(0, msecs));
+}
+
+void QPushbulletHandler::setStreamQueueLimit(int count)
+{
+    m_StreamQueueLimit = qMax(1, count);
+}
+
+void QPushbulletHandler::setStreamOverflowPolicy(STREAM_OVERFLOW_POLICY policy)
+{
+    m_StreamOverflowPolicy = policy;
+}
+
+int QPushbulletHandler::getStreamQueueDepth() const
+{
+    return m_StreamQueue.count();
+}
+
+void QPushbulletHandler::setCryptoThreadCount(int count)
+{
+    m_CryptoPool->setMaxThreadCount(qMax(1, count));
+}
+
+void QPushbulletHandler::setCryptoThreadPool(QThreadPool *pool)
+{
+    m_CryptoPool = pool ? pool : s_CryptoPool();
+}
+
 void QPushbulletHandler::parseDeviceResponse(const QByteArray &data)
 {
-    m_Devices.clear();
-    QString strReply = (QString)data;
-    QJsonDocument jsonResponse = QJsonDocument::fromJson(strReply.toUtf8());
+    const bool isDelta = m_CurrentOperation == CURRENT_OPERATION::UPDATE_DEVICE_LIST;
+    if (!isDelta)
+        m_Devices.clear();
+    QJsonDocument jsonResponse = QJsonDocument::fromJson(data);
     QJsonObject jsonObject = jsonResponse.object();
     QJsonArray jsonArray = jsonObject["devices"].toArray();
 
     foreach (const QJsonValue &value, jsonArray) {
         QJsonObject obj = value.toObject();
+        m_DevicesModifiedAfter = qMax(m_DevicesModifiedAfter, obj["modified"].toDouble());
+
         Device device;
+        device.ID = obj["iden"].toString();
         device.nickname = obj["nickname"].toString();
+        if (isDelta) {
+            //A delta contains the changed devices, including the deleted ones
+            auto foundIt = std::find_if(m_Devices.begin(), m_Devices.end(), [&device](const Device & d) {
+                return d.ID == device.ID;
+            });
+            if (foundIt != m_Devices.end())
+                m_Devices.erase(foundIt);
+            if (!obj["active"].toBool())
+                continue;
+        }
         if (device.nickname.isEmpty())
             continue;
         device.active = obj["active"].toBool();
         device.appVersion = obj["app_version"].toInt();
-        device.ID = obj["iden"].toString();
         device.manufacturer = obj["manufacturer"].toString();
         device.type = obj["type"].toString();
         device.pushable = obj["pushable"].toBool();
@@ -367,7 +1384,7 @@ void QPushbulletHandler::parseDeviceResponse(const QByteArray &data)
     emit didReceiveDevices(m_Devices);
 }
 
-void QPushbulletHandler::parseCreateDeviceResponse(const QByteArray &data)
+Device QPushbulletHandler::parseCreateDeviceResponse(const QByteArray &data)
 {
     QString strReply = (QString)data;
     QJsonDocument jsonResponse = QJsonDocument::fromJson(strReply.toUtf8());
@@ -384,9 +1401,10 @@ void QPushbulletHandler::parseCreateDeviceResponse(const QByteArray &data)
     device.nickname = jsonObject["nickname"].toString();
 
     emit didDeviceCreate(device);
+    return device;
 }
 
-void QPushbulletHandler::parseUpdateDeviceResponce(const QByteArray &data)
+Device QPushbulletHandler::parseUpdateDeviceResponce(const QByteArray &data)
 {
     QString strReply = (QString)data;
     QJsonDocument jsonResponse = QJsonDocument::fromJson(strReply.toUtf8());
@@ -403,31 +1421,45 @@ void QPushbulletHandler::parseUpdateDeviceResponce(const QByteArray &data)
     device.nickname = jsonObject["nickname"].toString();
 
     emit didDeviceUpdate(device);
+    return device;
 }
 
 void QPushbulletHandler::parseContactResponse(const QByteArray &data)
 {
-    m_Contacts.clear();
+    const bool isDelta = m_CurrentOperation == CURRENT_OPERATION::UPDATE_CONTACT_LIST;
+    if (!isDelta)
+        m_Contacts.clear();
 
-    QString strReply = (QString)data;
-    QJsonDocument jsonResponse = QJsonDocument::fromJson(strReply.toUtf8());
+    QJsonDocument jsonResponse = QJsonDocument::fromJson(data);
     QJsonObject jsonObject = jsonResponse.object();
     QJsonArray jsonArray = jsonObject["contacts"].toArray();
 
     foreach (const QJsonValue &value, jsonArray) {
         QJsonObject obj = value.toObject();
+        m_ContactsModifiedAfter = qMax(m_ContactsModifiedAfter, obj["modified"].toDouble());
+
         Contact contact;
+        contact.ID = obj["iden"].toString();
         contact.name = obj["name"].toString();
+        if (isDelta) {
+            //A delta contains the changed contacts, including the deleted ones
+            auto foundIt = std::find_if(m_Contacts.begin(), m_Contacts.end(), [&contact](const Contact & c) {
+                return c.ID == contact.ID;
+            });
+            if (foundIt != m_Contacts.end())
+                m_Contacts.erase(foundIt);
+            if (!obj["active"].toBool())
+                continue;
+        }
         if (contact.name.isEmpty())
             continue;
         contact.email = obj["email"].toString();
-        contact.ID = obj["iden"].toString();
         m_Contacts.append(contact);
     }
     emit didReceiveContacts(m_Contacts);
 }
 
-void QPushbulletHandler::parseCreateContactResponse(const QByteArray &data)
+Contact QPushbulletHandler::parseCreateContactResponse(const QByteArray &data)
 {
     QString strReply = (QString)data;
     QJsonDocument jsonResponse = QJsonDocument::fromJson(strReply.toUtf8());
@@ -439,9 +1471,10 @@ void QPushbulletHandler::parseCreateContactResponse(const QByteArray &data)
     contact.ID = jsonObject["iden"].toString();
 
     emit didContactCreate(contact);
+    return contact;
 }
 
-void QPushbulletHandler::parseUpdateContactResponse(const QByteArray &data)
+Contact QPushbulletHandler::parseUpdateContactResponse(const QByteArray &data)
 {
     QString strReply = (QString)data;
     QJsonDocument jsonResponse = QJsonDocument::fromJson(strReply.toUtf8());
@@ -453,36 +1486,69 @@ void QPushbulletHandler::parseUpdateContactResponse(const QByteArray &data)
     contact.ID = jsonObject["iden"].toString();
 
     emit didContactUpdate(contact);
+    return contact;
+}
+
+void QPushbulletHandler::handleDecryptedHistory(quint64 sequence, QJsonArray pushes)
+{
+    auto foundIt = m_PendingHistories.find(sequence);
+    if (foundIt == m_PendingHistories.end())
+        return;
+    foundIt.value().ready = true;
+    foundIt.value().pushes = pushes;
+
+    while (!m_PendingHistories.isEmpty() && m_PendingHistories.first().ready) {
+        const PendingHistory pending = m_PendingHistories.take(m_PendingHistories.firstKey());
+        const CURRENT_OPERATION current = m_CurrentOperation;
+        m_CurrentOperation = pending.operation;
+        QElapsedTimer parseTimer;
+        parseTimer.start();
+        parsePushHistory(pending.pushes);
+        m_Metrics.recordParse(getOperationName(m_CurrentOperation), parseTimer.nsecsElapsed() / 1000);
+        m_CurrentOperation = current;
+        if (pending.resolver)
+            pending.resolver(QVariant::fromValue(m_Pushes), PushbulletError());
+    }
 }
 
 void QPushbulletHandler::parsePushHistoryResponse(const QByteArray &data)
+{
+    //Replies from the network with encrypted pushes are decrypted on the pool instead, see handleNetworkData()
+    QJsonArray pushes = QJsonDocument::fromJson(data).object()["pushes"].toArray();
+    if (m_Crypto)
+        decryptPushes(pushes, m_Crypto);
+    parsePushHistory(pushes);
+}
+
+void QPushbulletHandler::parsePushHistory(const QJsonArray &pushes)
 {
     if (m_CurrentOperation != CURRENT_OPERATION::UPDATE_PUSH_LIST)
         m_Pushes.clear();
 
-    QString strReply = (QString)data;
-    QJsonDocument jsonResponse = QJsonDocument::fromJson(strReply.toUtf8());
-    QJsonObject jsonObject = jsonResponse.object();
-    QJsonArray jsonArray = jsonObject["pushes"].toArray();
+    //Lookups by ID are done with a set so large histories don't take quadratic time
+    QSet<QString> knownIDs;
+    knownIDs.reserve(m_Pushes.count());
+    for (const Push &p : m_Pushes)
+        knownIDs.insert(p.ID);
 
-    foreach (const QJsonValue &value, jsonArray) {
+    foreach (const QJsonValue &value, pushes) {
         QJsonObject jsonObject = value.toObject();
         Push push;
 
         if (jsonObject["active"].toBool() == false) {
             continue;
         }
+        //decryptPushes() removes the ciphertext of the pushes it could decrypt
+        if (jsonObject["encrypted"].toBool() && jsonObject.contains("ciphertext"))
+            qCWarning(lcPushbulletNetwork) << "Couldn't decrypt push" << jsonObject["iden"].toString();
 
         push.isActive = true;
         push.ID = jsonObject["iden"].toString();
 
-        auto foundIt = std::find_if(m_Pushes.begin(), m_Pushes.end(), [&push](const Push & p) {
-            return p.ID == push.ID;
-        });
-
-        if (foundIt != m_Pushes.end()) {
+        if (knownIDs.contains(push.ID)) {
             continue;
         }
+        knownIDs.insert(push.ID);
 
         push.type = getPushTypeFromString(jsonObject["type"].toString());
         push.targetDeviceID = jsonObject["target_device_iden"].toString();
@@ -490,6 +1556,7 @@ void QPushbulletHandler::parsePushHistoryResponse(const QByteArray &data)
         push.receiverEmail = jsonObject["receiver_email"].toString();
         push.modified = jsonObject["modified"].toDouble();
         push.created = jsonObject["created"].toDouble();
+        push.dismissed = jsonObject["dismissed"].toBool();
 
         if (push.type == getPushTypeFromString("note")) {
             push.title = jsonObject["title"].toString();
@@ -507,7 +1574,6 @@ void QPushbulletHandler::parsePushHistoryResponse(const QByteArray &data)
         else if (push.type == getPushTypeFromString("list")) {
             push.title = jsonObject["title"].toString();
             push.body = jsonObject["items"].toString();
-            qDebug() << push.body;
         }
         else if (push.type == getPushTypeFromString("file")) {
             push.fileName = jsonObject["file_name"].toString();
@@ -527,7 +1593,7 @@ void QPushbulletHandler::parsePushHistoryResponse(const QByteArray &data)
     emit didReceivePushHistory(m_Pushes);
 }
 
-void QPushbulletHandler::parsePushResponse(const QByteArray &data)
+Push QPushbulletHandler::parsePushResponse(const QByteArray &data)
 {
     QString strReply = (QString)data;
     QJsonDocument jsonResponse = QJsonDocument::fromJson(strReply.toUtf8());
@@ -542,6 +1608,8 @@ void QPushbulletHandler::parsePushResponse(const QByteArray &data)
     push.receiverEmail = jsonObject["receiver_email"].toString();
     push.modified = jsonObject["modified"].toDouble();
     push.created = jsonObject["created"].toDouble();
+    push.isActive = jsonObject["active"].toBool();
+    push.dismissed = jsonObject["dismissed"].toBool();
 
     if (push.type == getPushTypeFromString("note")) {
         push.title = jsonObject["title"].toString();
@@ -570,6 +1638,7 @@ void QPushbulletHandler::parsePushResponse(const QByteArray &data)
         emit didPushUpdate(push);
     else
         emit didPush(push);
+    return push;
 }
 
 PUSH_TYPE QPushbulletHandler::getPushTypeFromString(QString type)
@@ -588,23 +1657,140 @@ PUSH_TYPE QPushbulletHandler::getPushTypeFromString(QString type)
     return t;
 }
 
-void QPushbulletHandler::parseMirrorPush(QString data)
+void QPushbulletHandler::parseMirrorPush(const QString &data)
 {
     QJsonDocument jsonResponse = QJsonDocument::fromJson(data.toUtf8());
     QJsonObject jsonObject = jsonResponse.object();
     if (jsonObject["type"] == "tickle") {
-        parseTickle(jsonObject);
+        m_Metrics.recordTickle();
+        if (m_StreamBatchingEnabled) {
+            m_PendingTickles.insert(jsonObject["subtype"].toString());
+            if (!m_StreamBatchTimer.isActive())
+                m_StreamBatchTimer.start();
+        }
+        else {
+            parseTickle(jsonObject);
+        }
+        return;
+    }
+    else if (jsonObject["type"] == "nop") {
+        //Keep-alive frame
         return;
     }
 
     QJsonObject obj = jsonObject["push"].toObject();
+    if (obj["encrypted"].toBool()) {
+        if (!m_Crypto) {
+            qCWarning(lcPushbulletStream) << "Dropped an encrypted mirror, encryption is not enabled";
+            return;
+        }
+        const QByteArray ciphertext = obj["ciphertext"].toString().toLatin1();
+        m_CryptoPool->start(new DecryptionTask(m_CryptoTarget, m_Crypto, m_StreamSequence++, ciphertext));
+        return;
+    }
+
+    if (m_OrderedStream.isEmpty() && m_StreamSequence == m_NextStreamSequence) {
+        //Nothing is being decrypted, so there's nothing to wait for
+        m_StreamSequence++;
+        m_NextStreamSequence++;
+        deliverMirrorPush(createMirrorPush(obj));
+        return;
+    }
+    m_OrderedStream.insert(m_StreamSequence++, obj);
+    releaseOrderedStream();
+}
 
+void QPushbulletHandler::handleDecryptedMessage(quint64 sequence, QByteArray plaintext)
+{
+    const QJsonObject obj = QJsonDocument::fromJson(plaintext).object();
+    if (obj.isEmpty())
+        qCWarning(lcPushbulletStream) << "Couldn't decrypt a mirror, check the encryption password";
+    m_OrderedStream.insert(sequence, obj);
+    releaseOrderedStream();
+}
+
+void QPushbulletHandler::releaseOrderedStream()
+{
+    while (!m_OrderedStream.isEmpty() && m_OrderedStream.firstKey() == m_NextStreamSequence) {
+        const QJsonObject obj = m_OrderedStream.take(m_NextStreamSequence);
+        m_NextStreamSequence++;
+        if (!obj.isEmpty())
+            deliverMirrorPush(createMirrorPush(obj));
+    }
+}
+
+void QPushbulletHandler::deliverMirrorPush(const MirrorPush &mirror)
+{
+    if (!m_StreamBatchingEnabled) {
+        emit didReceiveMirrorPush(mirror);
+        return;
+    }
+
+    if (m_StreamQueue.count() >= m_StreamQueueLimit && m_StreamOverflowPolicy == STREAM_OVERFLOW_POLICY::BLOCK) {
+        flushStreamQueue();
+    }
+    else if (m_StreamQueue.count() >= m_StreamQueueLimit) {
+        bool coalesced = false;
+        if (m_StreamOverflowPolicy == STREAM_OVERFLOW_POLICY::COALESCE) {
+            //Newer updates of a notification are usually close to the older ones, so search from the back
+            for (int i = m_StreamQueue.count() - 1; i >= 0 && !coalesced; i--) {
+                const MirrorPush &queued = m_StreamQueue.at(i);
+                if (queued.notificationID == mirror.notificationID && queued.packageName == mirror.packageName
+                    && queued.notificationTag == mirror.notificationTag
+                    && queued.sourceDeviceID == mirror.sourceDeviceID) {
+                    m_StreamQueue.removeAt(i);
+                    coalesced = true;
+                }
+            }
+        }
+        if (!coalesced)
+            m_StreamQueue.removeFirst();
+        m_Metrics.recordStreamOverflow(coalesced);
+    }
+
+    m_StreamQueue.append(mirror);
+    if (!m_StreamBatchTimer.isActive())
+        m_StreamBatchTimer.start();
+}
+
+void QPushbulletHandler::flushStreamQueue()
+{
+    m_StreamBatchTimer.stop();
+    //Taken before anything is emitted, so slots can safely cause new deliveries
+    const QSet<QString> tickles = m_PendingTickles;
+    m_PendingTickles.clear();
+    const MirrorPushList mirrors = m_StreamQueue;
+    m_StreamQueue.clear();
+
+    for (const QString &subtype : tickles) {
+        QJsonObject tickle;
+        tickle["subtype"] = subtype;
+        parseTickle(tickle);
+    }
+    if (!mirrors.isEmpty())
+        emit didReceiveMirrorPushBatch(mirrors);
+}
+
+MirrorPush QPushbulletHandler::createMirrorPush(const QJsonObject &obj)
+{
     MirrorPush mirror;
 
     mirror.type = obj["type"].toString();
     mirror.subtype = obj["subtype"].toString();
-
-    emit didReceiveMirrorPush(mirror);
+    mirror.title = obj["title"].toString();
+    mirror.body = obj["body"].toString();
+    mirror.applicationName = obj["application_name"].toString();
+    mirror.packageName = obj["package_name"].toString();
+    mirror.sourceDeviceID = obj["source_device_iden"].toString();
+    mirror.sourceUserID = obj["source_user_iden"].toString();
+    mirror.targetDeviceID = obj["target_device_iden"].toString();
+    mirror.notificationID = obj["notification_id"].toString();
+    mirror.notificationTag = obj["notification_tag"].toString();
+    mirror.conversationID = obj["conversation_iden"].toString();
+    mirror.dismissible = obj["dismissible"].toBool();
+    if (m_MirrorIconsEnabled)
+        mirror.icon = obj["icon"].toString();
+    return mirror;
 }
 
 void QPushbulletHandler::parseTickle(QJsonObject jsonObject)
@@ -642,6 +1828,33 @@ QString QPushbulletHandler::getDeviceNameFromDeviceID(QString deviceID)
     return name;
 }
 
+void QPushbulletHandler::requestFileDownload(QString url)
+{
+    if (m_FileCache) {
+        const QByteArray data = m_FileCache->get(url);
+        if (!data.isEmpty()) {
+            emit didDownloadFile(url, data);
+            return;
+        }
+    }
+
+    qCDebug(lcPushbulletNetwork) << "GET file" << QUrl(url).path();
+    if (m_OfflineMode)
+        return;
+    m_CurrentOperation = CURRENT_OPERATION::DOWNLOAD_FILE;
+    m_Metrics.recordRequest(getOperationName(m_CurrentOperation), 0);
+    //Files are served from another host, so the Access-Token isn't sent with them
+    QNetworkRequest request((QUrl(url)));
+    QNetworkReply *reply = m_NetworkManager->get(request);
+    reply->setProperty("fileURL", url);
+    trackReply(reply);
+}
+
+void QPushbulletHandler::setFileCache(QPushbulletFileCache *cache)
+{
+    m_FileCache = cache;
+}
+
 void QPushbulletHandler::requestUploadFile(QString fileName, QString filePath)
 {
     m_FilePath = filePath;
@@ -676,18 +1889,21 @@ void QPushbulletHandler::parseUploadRequestResponse(const QByteArray &data)
 
     QUrl url(jsonObject["upload_url"].toString());
     url.setQuery(query);
-    qDebug() << url.toString();
+    qCDebug(lcPushbulletNetwork) << url.toString();
 }
 
 void QPushbulletHandler::postMultipart(QUrl url, QUrlQuery query)
 {
+    if (m_OfflineMode)
+        return;
+
     m_MultiPart = new QHttpMultiPart(QHttpMultiPart::FormDataType);
 
     QHttpPart imagePart;
     imagePart.setHeader(QNetworkRequest::ContentTypeHeader, QVariant("application/json"));
     m_File = new QFile("/Users/Furkanzmc/Desktop/response.json");
     if (!m_File->open(QIODevice::ReadOnly))
-        qDebug() << m_File->errorString();
+        qCWarning(lcPushbulletNetwork) << m_File->errorString();
     imagePart.setHeader(QNetworkRequest::ContentDispositionHeader, QVariant("form-data; name=\"response\";filename=\"response.json\""));
     imagePart.setBodyDevice(m_File);
     m_File->setParent(m_MultiPart); // we cannot delete the file now, so delete it with the multiPart
@@ -699,8 +1915,9 @@ void QPushbulletHandler::postMultipart(QUrl url, QUrlQuery query)
     request.setRawHeader(QString("Content-Type").toUtf8(), QString("multipart/form-data;boundary=\"margin\"").toUtf8());
     request.setRawHeader(QString("Content-Length").toUtf8(), QString(m_File->readAll().length()).toUtf8());
 
-    qDebug() << "Length: " << QString(m_File->readAll());
-    QNetworkReply *reply = m_NetworkManager.put(request, m_MultiPart);
+    qCDebug(lcPushbulletNetwork) << "Length: " << QString(m_File->readAll());
+    QNetworkReply *reply = m_NetworkManager->put(request, m_MultiPart);
+    trackReply(reply);
     m_MultiPart->setParent(reply);
     connect(reply, SIGNAL(uploadProgress(qint64, qint64)), this, SLOT(uploadProgress(qint64, qint64)));
     connect(reply, SIGNAL(error(QNetworkReply::NetworkError)), this, SLOT(uploadError(QNetworkReply::NetworkError)));
@@ -709,10 +1926,17 @@ void QPushbulletHandler::postMultipart(QUrl url, QUrlQuery query)
 
 void QPushbulletHandler::registerForRealTimeEventStream()
 {
-    //Connect QWebSocket signals
-    connect(&m_WebSocket, SIGNAL(connected()), this, SLOT(webSocketConnected()));
-    const QString socketURL = "wss://stream.pushbullet.com/websocket/" + m_APIKey;
-    m_WebSocket.open(QUrl(socketURL));
+    //The socket is only created when it's needed, so handlers that never use the stream don't hold one
+    if (!m_WebSocket) {
+        m_WebSocket = new QWebSocket(QString(), QWebSocketProtocol::VersionLatest, this);
+        //Connect QWebSocket signals
+        connect(m_WebSocket, SIGNAL(connected()), this, SLOT(webSocketConnected()));
+        connect(m_WebSocket, SIGNAL(disconnected()), this, SLOT(webSocketDisconnected()));
+        connect(m_WebSocket, SIGNAL(textMessageReceived(QString)), this, SLOT(textMessageReceived(QString)));
+    }
+
+    const QString socketURL = m_URLStream.toString() + m_APIKey;
+    m_WebSocket->open(QUrl(socketURL));
 }
 
 QNetworkAccessManager::NetworkAccessibility QPushbulletHandler::getNetworkAccessibility()
@@ -720,6 +1944,166 @@ QNetworkAccessManager::NetworkAccessibility QPushbulletHandler::getNetworkAccess
     return m_NetworkAccessibility;
 }
 
+QString QPushbulletHandler::getOperationName(CURRENT_OPERATION operation)
+{
+    switch (operation) {
+    case CURRENT_OPERATION::GET_DEVICE_LIST: return "get_device_list";
+    case CURRENT_OPERATION::GET_CONTACT_LIST: return "get_contact_list";
+    case CURRENT_OPERATION::GET_PUSH_HISTORY: return "get_push_history";
+    case CURRENT_OPERATION::PUSH: return "push";
+    case CURRENT_OPERATION::PUSH_UPDATE: return "push_update";
+    case CURRENT_OPERATION::DELETE_PUSH: return "delete_push";
+    case CURRENT_OPERATION::UPDATE_PUSH_LIST: return "update_push_list";
+    case CURRENT_OPERATION::UPDATE_DEVICE_LIST: return "update_device_list";
+    case CURRENT_OPERATION::UPDATE_CONTACT_LIST: return "update_contact_list";
+    case CURRENT_OPERATION::CREATE_DEVICE: return "create_device";
+    case CURRENT_OPERATION::UPDATE_DEVICE: return "update_device";
+    case CURRENT_OPERATION::DELETE_DEVICE: return "delete_device";
+    case CURRENT_OPERATION::CREATE_CONTACT: return "create_contact";
+    case CURRENT_OPERATION::UPDATE_CONTACT: return "update_contact";
+    case CURRENT_OPERATION::DELETE_CONTACT: return "delete_contact";
+    case CURRENT_OPERATION::REQUEST_UPLOAD_FILE: return "request_upload_file";
+    case CURRENT_OPERATION::UPLOAD_FILE: return "upload_file";
+    case CURRENT_OPERATION::PUSH_EPHEMERAL: return "push_ephemeral";
+    case CURRENT_OPERATION::BULK_PUSH_UPDATE: return "bulk_push_update";
+    case CURRENT_OPERATION::BULK_PUSH_DELETE: return "bulk_push_delete";
+    case CURRENT_OPERATION::DELETE_ALL_PUSHES: return "delete_all_pushes";
+    case CURRENT_OPERATION::GET_USER: return "get_user";
+    case CURRENT_OPERATION::DOWNLOAD_FILE: return "download_file";
+    case CURRENT_OPERATION::NONE: return "none";
+    }
+    return "none";
+}
+
+QPushbulletMetrics QPushbulletHandler::getMetrics() const
+{
+    QPushbulletMetrics metrics = m_Metrics;
+    metrics.setQueueDepth("pending_requests", m_PendingReplies.count());
+    metrics.setQueueDepth("ephemerals_queued", m_EphemeralQueue.count());
+    metrics.setQueueDepth("ephemerals_in_flight", m_EphemeralsInFlight);
+    qint64 bulkQueued = 0;
+    for (const BulkOperation &bulk : m_BulkOperations)
+        bulkQueued += bulk.queue.count();
+    metrics.setQueueDepth("bulk_queued", bulkQueued);
+    metrics.setQueueDepth("bulk_in_flight", m_BulkRequestsInFlight);
+    metrics.setQueueDepth("stream_reordering", static_cast<qint64>(m_StreamSequence - m_NextStreamSequence));
+    metrics.setQueueDepth("stream_queued", m_StreamQueue.count());
+    return metrics;
+}
+
+QNetworkAccessManager *QPushbulletHandler::getNetworkManager()
+{
+    return m_NetworkManager;
+}
+
+void QPushbulletHandler::setTraceRecorder(QPushbulletTraceRecorder *recorder)
+{
+    m_TraceRecorder = recorder;
+    if (m_TraceRecorder)
+        m_TraceRecorder->addRedaction(m_APIKey.toUtf8());
+}
+
+void QPushbulletHandler::setAPIBaseURL(QUrl baseURL)
+{
+    QString base = baseURL.toString();
+    if (base.endsWith('/'))
+        base.chop(1);
+
+    m_URLContacts = QUrl(base + "/contacts");
+    m_URLDevices = QUrl(base + "/devices");
+    m_URLMe = QUrl(base + "/users/me");
+    m_URLPushes = QUrl(base + "/pushes");
+    m_URLUploadRequest = QUrl(base + "/upload-request");
+    m_URLEphemerals = QUrl(base + "/ephemerals");
+}
+
+void QPushbulletHandler::setStreamBaseURL(QUrl baseURL)
+{
+    m_URLStream = baseURL;
+}
+
+void QPushbulletHandler::prewarmConnection()
+{
+    if (m_OfflineMode)
+        return;
+
+    if (m_URLMe.scheme() != "https") {
+        m_NetworkManager->connectToHost(m_URLMe.host(), m_URLMe.port(80));
+    }
+    else {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+        m_NetworkManager->connectToHostEncrypted(m_URLMe.host(), m_URLMe.port(443), getSslConfiguration());
+#else
+        m_NetworkManager->connectToHostEncrypted(m_URLMe.host(), m_URLMe.port(443));
+#endif
+    }
+}
+
+void QPushbulletHandler::setConnectionPrewarmEnabled(bool enabled)
+{
+    m_PrewarmEnabled = enabled;
+    if (m_PrewarmEnabled)
+        prewarmConnection();
+}
+
+void QPushbulletHandler::setHttp2Enabled(bool enabled)
+{
+    m_Http2Enabled = enabled;
+}
+
+void QPushbulletHandler::setTlsSessionReuseEnabled(bool enabled)
+{
+    m_TlsSessionReuseEnabled = enabled;
+}
+
+void QPushbulletHandler::setTlsSessionTicket(const QByteArray &ticket)
+{
+    m_SessionTicket = ticket;
+}
+
+QByteArray QPushbulletHandler::getTlsSessionTicket() const
+{
+    return m_SessionTicket;
+}
+
+int QPushbulletHandler::getPendingRequestCount() const
+{
+    return m_PendingReplies.count();
+}
+
+bool QPushbulletHandler::isRealTimeEventStreamOpen() const
+{
+    return m_WebSocket && m_WebSocket->state() != QAbstractSocket::UnconnectedState;
+}
+
+qint64 QPushbulletHandler::getApproximateMemoryUsage() const
+{
+    qint64 usage = sizeof(QPushbulletHandler);
+    if (m_NetworkManager->parent() == this)
+        usage += sizeof(QNetworkAccessManager);
+    if (m_WebSocket)
+        usage += sizeof(QWebSocket);
+
+    for (const Device &device : m_Devices) {
+        usage += sizeof(Device);
+        usage += (device.ID.size() + device.pushToken.size() + device.nickname.size() + device.manufacturer.size()
+                  + device.type.size()) * sizeof(QChar);
+    }
+    for (const Contact &contact : m_Contacts) {
+        usage += sizeof(Contact);
+        usage += (contact.ID.size() + contact.name.size() + contact.email.size()) * sizeof(QChar);
+    }
+    for (const Push &push : m_Pushes) {
+        usage += sizeof(Push);
+        usage += (push.ID.size() + push.title.size() + push.body.size() + push.url.size() + push.targetDeviceID.size()
+                  + push.senderEmail.size() + push.receiverEmail.size() + push.addressName.size() + push.address.size()
+                  + push.fileName.size() + push.fileType.size() + push.fileURL.size()) * sizeof(QChar);
+        for (const QString &item : push.listItems)
+            usage += item.size() * sizeof(QChar);
+    }
+    return usage;
+}
+
 const DeviceList QPushbulletHandler::getDeviceList()
 {
     return m_Devices;
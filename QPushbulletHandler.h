@@ -3,6 +3,11 @@
 #include <QObject>
 #include <QtNetwork>
 #include <QtWebSockets>
+#include "QPushbulletMetrics.h"
+#include "QPushbulletFuture.h"
+#include "QPushbulletCrypto.h"
+#include <functional>
+#include <memory>
 
 enum class PUSH_TYPE {
     NOTE,
@@ -29,23 +34,51 @@ struct Push {
     PUSH_TYPE type;
     double modified, created;
     QStringList listItems;
-    bool isActive;
+    bool isActive, dismissed;
 };
 struct MirrorPush {
     QString type = "", subtype = "";
+    QString title, body, applicationName, packageName, sourceDeviceID, sourceUserID, targetDeviceID, notificationID,
+            notificationTag, conversationID;
+    //Base64 encoded image. It's left empty unless QPushbulletHandler::setMirrorIconsEnabled(true) is called.
+    QString icon;
+    bool dismissible = false;
+};
+struct BulkItemResult {
+    QString pushID;
+    bool ok = false;
+    //0 if the request wasn't sent
+    int httpStatus = 0;
+    QString error;
 };
 
 typedef QList<Device> DeviceList;
 typedef QList<Contact> ContactList;
 typedef QList<Push> PushList;
+typedef QList<BulkItemResult> BulkResultList;
+typedef QList<MirrorPush> MirrorPushList;
+
+Q_DECLARE_METATYPE(Device)
+Q_DECLARE_METATYPE(Contact)
+Q_DECLARE_METATYPE(Push)
 
-//NOTE: Do not call any requests before the current request is finished
+class QPushbulletTraceRecorder;
+class QPushbulletFileCache;
+struct QPushbulletCryptoTarget;
+
+//Requests can overlap, every reply is parsed for the operation it was sent for
 class QPushbulletHandler : public QObject
 {
     Q_OBJECT
+    friend class QPushbulletTraceReplayer;
 
 public:
-    QPushbulletHandler(QString apiKey);
+    /**
+     * @brief Creates a handler for the given account. If networkManager is given, it's shared with the other handlers
+     * using it (See QPushbulletPool) instead of creating a new one for this handler.
+     */
+    QPushbulletHandler(QString apiKey, QNetworkAccessManager *networkManager = nullptr);
+    ~QPushbulletHandler();
 
 public:
     enum class CURRENT_OPERATION {
@@ -56,6 +89,8 @@ public:
         PUSH_UPDATE,
         DELETE_PUSH,
         UPDATE_PUSH_LIST,
+        UPDATE_DEVICE_LIST,
+        UPDATE_CONTACT_LIST,
         CREATE_DEVICE,
         UPDATE_DEVICE,
         DELETE_DEVICE,
@@ -64,22 +99,62 @@ public:
         DELETE_CONTACT,
         REQUEST_UPLOAD_FILE,
         UPLOAD_FILE,
+        PUSH_EPHEMERAL,
+        BULK_PUSH_UPDATE,
+        BULK_PUSH_DELETE,
+        DELETE_ALL_PUSHES,
+        GET_USER,
+        DOWNLOAD_FILE,
         NONE
     };
 
+    typedef std::function<bool(const Push &push)> PushPredicate;
+
+    /**
+     * What to do with a mirror that arrives while the batched stream queue is full
+     */
+    enum class STREAM_OVERFLOW_POLICY {
+        //Drop the oldest queued mirror
+        DROP_OLDEST,
+        //Replace the queued mirror of the same notification, or drop the oldest one if there's none
+        COALESCE,
+        //Deliver the queued mirrors right away, before reading the next frame
+        BLOCK
+    };
+
+    struct RequestTiming {
+        CURRENT_OPERATION operation;
+        //In microseconds, measured from sending the request
+        qint64 timeToFirstByte, totalTime;
+        //True if an earlier reply arrived recently enough that the connection is still kept open. Pre-warming isn't
+        //counted, it has no way to tell when the connection is up, but it shows in timeToFirstByte.
+        bool warm;
+    };
+
+    struct TransferStats {
+        CURRENT_OPERATION operation;
+        //The size of the decoded body. Qt decodes gzip itself and drops Content-Length, so the compressed size isn't
+        //known. bytesSaved is what a delta or a 304 saved compared to the last full list.
+        qint64 bytes, bytesSaved;
+        //True if the server answered 304 and the local list was reused without parsing
+        bool notModified;
+    };
+
 private:
     DeviceList m_Devices;
     ContactList m_Contacts;
     PushList m_Pushes;
     CURRENT_OPERATION m_CurrentOperation;
 
-    QNetworkAccessManager m_NetworkManager;
-    QWebSocket m_WebSocket;
-    const QUrl m_URLContacts,
-          m_URLDevices,
-          m_URLMe,
-          m_URLPushes,
-          m_URLUploadRequest;
+    QNetworkAccessManager *m_NetworkManager;
+    QWebSocket *m_WebSocket;
+    QUrl m_URLContacts,
+         m_URLDevices,
+         m_URLMe,
+         m_URLPushes,
+         m_URLUploadRequest,
+         m_URLEphemerals,
+         m_URLStream;
     const QString m_APIKey;
     QNetworkAccessManager::NetworkAccessibility m_NetworkAccessibility;
 
@@ -87,6 +162,88 @@ private:
     QHttpMultiPart *m_MultiPart;
     QFile *m_File;
 
+    //Replies sent but not finished. The manager may be shared and outlive the handler, so they're aborted with it.
+    QSet<QNetworkReply *> m_PendingReplies;
+
+    QElapsedTimer m_Clock;
+    //Since the last API reply, invalid if there was none or the connection may have closed since
+    QElapsedTimer m_LastAPIReply;
+    bool m_PrewarmEnabled, m_Http2Enabled, m_TlsSessionReuseEnabled;
+    QByteArray m_SessionTicket;
+
+    //Sync points for modified_after deltas and the validators of the last full lists
+    double m_DevicesModifiedAfter, m_ContactsModifiedAfter;
+    QByteArray m_DevicesETag, m_ContactsETag;
+    //Since the last full list, invalid if the next fetch must be a full one
+    QElapsedTimer m_DevicesRevalidated, m_ContactsRevalidated;
+    qint64 m_FullListInterval;
+    qint64 m_DeviceListSize, m_ContactListSize;
+
+    bool m_MirrorIconsEnabled;
+    //Outgoing ephemerals wait here so a burst of dismissals and replies is coalesced and sent a few at a time
+    QList<QJsonObject> m_EphemeralQueue;
+    QTimer m_EphemeralTimer;
+    int m_EphemeralsInFlight, m_MaxEphemeralRequests;
+
+    QPushbulletTraceRecorder *m_TraceRecorder;
+    //Set while a trace is replayed, so requests are dropped instead of sent
+    bool m_OfflineMode;
+
+    QPushbulletMetrics m_Metrics;
+
+    typedef std::function<void(const QVariant &result, const PushbulletError &error)> Resolver;
+    //Resolves the futures of the async requests when their replies finish
+    QHash<QNetworkReply *, Resolver> m_Resolvers;
+    QNetworkReply *m_LastReply;
+
+    struct BulkOperation {
+        bool dismiss;
+        QStringList queue;
+        int inFlight = 0;
+        BulkResultList results;
+        //Local copies of the pushes changed optimistically, restored if their request fails
+        QHash<QString, Push> originals;
+        //Originals of failed items, put back into m_Pushes together
+        QList<Push> failed;
+    };
+    QMap<int, BulkOperation> m_BulkOperations;
+    int m_NextBulkID, m_BulkRequestsInFlight, m_MaxBulkRequests;
+
+    //End-to-end encryption. The key is derived and messages are decrypted on m_CryptoPool, which is shared by all
+    //handlers unless one is set. Tasks reach the handler through m_CryptoTarget, which is cleared when it's destroyed.
+    QPushbulletCryptoPointer m_Crypto;
+    QString m_UserID;
+    //Kept only until the user iden needed as the salt arrives
+    QByteArray m_PendingPassword;
+    int m_KeyGeneration;
+    QThreadPool *m_CryptoPool;
+    std::shared_ptr<QPushbulletCryptoTarget> m_CryptoTarget;
+    //Mirrors are numbered as they arrive and held here until the ones before them are decrypted, so they're emitted in
+    //order. An empty object stands for a mirror that couldn't be decrypted.
+    QMap<quint64, QJsonObject> m_OrderedStream;
+    quint64 m_StreamSequence, m_NextStreamSequence;
+    //Push histories decrypted on m_CryptoPool, by arrival. They're applied in that order once the ones before them are
+    //ready, so a full history can't overwrite a newer delta.
+    struct PendingHistory {
+        CURRENT_OPERATION operation;
+        Resolver resolver;
+        bool ready = false;
+        QJsonArray pushes;
+    };
+    QMap<quint64, PendingHistory> m_PendingHistories;
+    quint64 m_HistorySequence;
+
+    //Batched stream delivery. Mirrors wait in m_StreamQueue and tickles in m_PendingTickles until m_StreamBatchTimer
+    //fires, so a storm of frames becomes a few signals.
+    bool m_StreamBatchingEnabled;
+    MirrorPushList m_StreamQueue;
+    QSet<QString> m_PendingTickles;
+    QTimer m_StreamBatchTimer;
+    int m_StreamQueueLimit;
+    STREAM_OVERFLOW_POLICY m_StreamOverflowPolicy;
+
+    QPushbulletFileCache *m_FileCache;
+
 signals:
     void didReceiveDevices(const DeviceList &devices);
     void didDeviceCreate(const Device &device);
@@ -102,8 +259,31 @@ signals:
     void didPush(const Push &push);
     void didPushUpdate(const Push &push);
     void didPushDelete();
+    /**
+     * @brief Gets emitted when every item of a bulk dismissal or delete has a result
+     * @param operationID The ID returned by requestPushesDismissal() or requestPushesDelete()
+     * @param results One result per push ID. requestDeleteAllPushes() adds one with an empty push ID for the request
+     * itself.
+     */
+    void didFinishBulkOperation(int operationID, const BulkResultList &results);
 
     void didReceiveMirrorPush(const MirrorPush &mirror);
+    /**
+     * @brief Gets emitted instead of didReceiveMirrorPush when batched stream delivery is enabled
+     * @param mirrors In the order they arrived
+     */
+    void didReceiveMirrorPushBatch(const MirrorPushList &mirrors);
+    void didPushEphemeral();
+    /**
+     * @brief Gets emitted when the key of setEncryptionPassword() is ready and encrypted mirrors can be read
+     */
+    void didEnableEncryption();
+    /**
+     * @brief Gets emitted when encryption couldn't be turned on, because the user iden couldn't be fetched or the key
+     * couldn't be derived. The password is wiped, call setEncryptionPassword() again to retry.
+     */
+    void didFailEncryption();
+    void didDownloadFile(const QString &url, const QByteArray &data);
 
     /**
      * @brief Gets emitted when QNetworkAccessManager encounters a problem
@@ -112,6 +292,20 @@ signals:
      */
     void didReceiveError(const QNetworkReply *networkReply);
 
+    /**
+     * @brief Gets emitted after a reply is handled, whether it failed or not
+     */
+    void didFinishRequest();
+
+    void didMeasureRequestTiming(const QPushbulletHandler::RequestTiming &timing);
+    /**
+     * @brief Gets emitted when the server gives a new TLS session ticket. Save it and pass it to setTlsSessionTicket()
+     * after a restart to skip the full TLS handshake.
+     * @param ticket
+     */
+    void didReceiveTlsSessionTicket(const QByteArray &ticket);
+    void didMeasureTransfer(const QPushbulletHandler::TransferStats &stats);
+
 private slots:
     void handleNetworkData(QNetworkReply *networkReply);
     void sessionConnected();
@@ -119,23 +313,65 @@ private slots:
     void webSocketConnected();
     void webSocketDisconnected();
     void textMessageReceived(QString message);
+    void flushEphemerals();
+    void flushBulkOperations();
+    void handleKeyDerived(int generation, QPushbulletCryptoPointer crypto);
+    void handleDecryptedMessage(quint64 sequence, QByteArray plaintext);
+    void handleDecryptedHistory(quint64 sequence, QJsonArray pushes);
+    void flushStreamQueue();
 
 private:
-    void getRequest(QUrl url);
-    void postRequest(QUrl url, const QByteArray &data);
+    QNetworkReply *getRequest(QUrl url, const QByteArray &etag = QByteArray());
+    QNetworkReply *postRequest(QUrl url, const QByteArray &data);
+    void trackReply(QNetworkReply *reply);
+    void handleBulkReply(QNetworkReply *networkReply, qint64 latency);
+    int startBulkOperation(QStringList pushIDs, bool dismiss);
+    void finishBulkItem(BulkOperation &bulk, const QString &pushID, bool ok, int httpStatus, const QString &error);
+    void restoreFailedPushes(BulkOperation &bulk);
+    QNetworkRequest createAPIRequest(QUrl url);
+    QSslConfiguration getSslConfiguration();
+
+    TransferStats getTransferStats(QNetworkReply *networkReply, const QByteArray &response);
+    /**
+     * @brief Parses the response of m_CurrentOperation and emits its signal
+     * @return The typed result for the future of the request, if there is one
+     */
+    QVariant processResponse(const QByteArray &response, bool notModified, const QByteArray &etag);
+    void attachResolver(Resolver resolver);
+
+    template<typename T>
+    QFuture<PushbulletResult<T>> createFuture()
+    {
+        typedef QFutureInterface<PushbulletResult<T>> Interface;
+        std::shared_ptr<Interface> futureInterface(new Interface());
+        futureInterface->reportStarted();
+        attachResolver([futureInterface](const QVariant &value, const PushbulletError &error) {
+            PushbulletResult<T> result;
+            result.value = value.value<T>();
+            result.error = error;
+            futureInterface->reportResult(result);
+            futureInterface->reportFinished();
+        });
+        return futureInterface->future();
+    }
 
     void parseDeviceResponse(const QByteArray &data);
-    void parseCreateDeviceResponse(const QByteArray &data);
-    void parseUpdateDeviceResponce(const QByteArray &data);
+    Device parseCreateDeviceResponse(const QByteArray &data);
+    Device parseUpdateDeviceResponce(const QByteArray &data);
 
     void parseContactResponse(const QByteArray &data);
-    void parseCreateContactResponse(const QByteArray &data);
-    void parseUpdateContactResponse(const QByteArray &data);
+    Contact parseCreateContactResponse(const QByteArray &data);
+    Contact parseUpdateContactResponse(const QByteArray &data);
 
     void parsePushHistoryResponse(const QByteArray &data);
-    void parsePushResponse(const QByteArray &data);
-
-    void parseMirrorPush(QString data);
+    void parsePushHistory(const QJsonArray &pushes);
+    Push parsePushResponse(const QByteArray &data);
+
+    void parseMirrorPush(const QString &data);
+    MirrorPush createMirrorPush(const QJsonObject &obj);
+    void releaseOrderedStream();
+    void deliverMirrorPush(const MirrorPush &mirror);
+    void startKeyDerivation(const QByteArray &password);
     void parseTickle(QJsonObject jsonObject);
 
     void requestPush(Push &push, QString deviceID, QString email);
@@ -149,15 +385,28 @@ private:
     void postMultipart(QUrl url, QUrlQuery query);
 
 public:
+    /**
+     * @brief Fetches the device list. After the first full list only the changes are fetched with modified_after. The
+     * full list is fetched again, revalidated with its ETag, after a delta fails and every setFullListInterval().
+     */
     void requestDeviceList();
     void requestCreateDevice(QString deviceName, QString model);
     void requestDeviceUpdate(QString deviceID, QString newNickname);
     void requestDeviceDelete(QString deviceID);
 
+    /**
+     * @brief Fetches the contact list. After the first full list only the changes are fetched with modified_after.
+     */
     void requestContactList();
     void requestCreateContact(QString name, QString email);
     void requestContactUpdate(QString contactID, QString newName);
     void requestContactDelete(QString contactID);
+    /**
+     * @brief How often the device and contact lists are fetched in full instead of as a delta, an hour by default. 0
+     * always fetches them in full.
+     * @param msecs
+     */
+    void setFullListInterval(qint64 msecs);
 
     void requestPushHistory();
     void requestPushHistory(double modifiedAfter);
@@ -167,12 +416,188 @@ public:
     void requestPushUpdate(QString pushID, bool dismissed);
     void requestPushDelete(QString pushID);
 
+    /**
+     * @brief Dismisses or deletes many pushes with a few requests in flight at a time. The local push list is changed
+     * right away and pushes whose request fails are put back.
+     * @return An ID for didFinishBulkOperation
+     */
+    int requestPushesDismissal(QStringList pushIDs);
+    int requestPushesDismissal(PushPredicate predicate);
+    int requestPushesDelete(QStringList pushIDs);
+    int requestPushesDelete(PushPredicate predicate);
+    /**
+     * @brief Deletes every push of the account with a single request, including the ones not fetched yet. The local
+     * push list is cleared right away and put back if the request fails.
+     * @return An ID for didFinishBulkOperation, with a result for the request, whose push ID is empty, and one for each
+     * push that was in the local list
+     */
+    int requestDeleteAllPushes();
+    void setMaxBulkRequests(int count);
+
+    /**
+     * @brief Downloads the file of a file push. If the file cache has it, didDownloadFile is emitted right away without
+     * a request.
+     * @param url The fileURL of the push
+     */
+    void requestFileDownload(QString url);
+    /**
+     * @brief Downloaded files are stored in and served from this cache. The handler doesn't take ownership.
+     * @param cache
+     */
+    void setFileCache(QPushbulletFileCache *cache);
+
+    /**
+     * The Async variants send the same requests but return a future that resolves with the typed result of that
+     * request or its error, so overlapping requests can be told apart. The signals are still emitted. Use whenAll() to
+     * wait for several of them. Ephemerals have none, they are queued and coalesced so one may never get a reply of
+     * its own. Bulk operations report with didFinishBulkOperation and downloads with didDownloadFile.
+     */
+    QFuture<PushbulletResult<DeviceList>> requestDeviceListAsync();
+    QFuture<PushbulletResult<Device>> requestCreateDeviceAsync(QString deviceName, QString model);
+    QFuture<PushbulletResult<Device>> requestDeviceUpdateAsync(QString deviceID, QString newNickname);
+    QFuture<PushbulletResult<bool>> requestDeviceDeleteAsync(QString deviceID);
+
+    QFuture<PushbulletResult<ContactList>> requestContactListAsync();
+    QFuture<PushbulletResult<Contact>> requestCreateContactAsync(QString name, QString email);
+    QFuture<PushbulletResult<Contact>> requestContactUpdateAsync(QString contactID, QString newName);
+    QFuture<PushbulletResult<bool>> requestContactDeleteAsync(QString contactID);
+
+    QFuture<PushbulletResult<PushList>> requestPushHistoryAsync();
+    QFuture<PushbulletResult<PushList>> requestPushHistoryAsync(double modifiedAfter);
+    QFuture<PushbulletResult<Push>> requestPushToDeviceAsync(Push push, QString deviceID);
+    QFuture<PushbulletResult<Push>> requestPushToContactAsync(Push push, QString email);
+    QFuture<PushbulletResult<Push>> requestPushToAllDevicesAsync(Push push);
+    QFuture<PushbulletResult<Push>> requestPushUpdateAsync(QString pushID, bool dismissed);
+    QFuture<PushbulletResult<bool>> requestPushDeleteAsync(QString pushID);
+
+    /**
+     * @brief Queues an ephemeral to be sent to /v2/ephemerals. Queued ephemerals are sent after the flush interval with
+     * a few requests at a time, and a newer dismissal of the same notification replaces the queued one.
+     * @param push The "push" object of the ephemeral, e.g. {"type": "dismissal", ...}
+     */
+    void requestEphemeral(const QJsonObject &push);
+    /**
+     * @brief Dismisses the mirrored notification on the device it came from
+     * @param mirror
+     */
+    void requestEphemeralDismissal(const MirrorPush &mirror);
+    /**
+     * @brief Replies to the conversation of a mirrored messaging notification
+     * @param mirror
+     * @param message
+     */
+    void requestEphemeralReply(const MirrorPush &mirror, QString message);
+    void setEphemeralFlushInterval(int msecs);
+    void setMaxEphemeralRequests(int count);
+    /**
+     * @brief Mirror icons can be large, so they're skipped unless enabled
+     * @param enabled
+     */
+    void setMirrorIconsEnabled(bool enabled);
+
+    /**
+     * @brief Enables end-to-end encryption with the password set in the Pushbullet apps. Encrypted mirrors are
+     * decrypted and outgoing ephemerals are encrypted once didEnableEncryption is emitted. An empty password disables
+     * it. The key is derived once per password and user in the background.
+     * @param password
+     * @param userID The user iden used as the salt. If it's empty, it's fetched from /users/me first.
+     */
+    void setEncryptionPassword(QString password, QString userID = QString());
+    bool isEncryptionEnabled() const;
+    /**
+     * @brief Sets the thread count of the crypto pool. Unless setCryptoThreadPool() was called, the pool is shared by
+     * every handler of the process, so this applies to all of them.
+     * @param count
+     */
+    void setCryptoThreadCount(int count);
+    /**
+     * @brief Runs key derivation and decryption on this pool instead of the shared one. The handler doesn't take
+     * ownership. Set it before encryption is enabled.
+     * @param pool
+     */
+    void setCryptoThreadPool(QThreadPool *pool);
+
+    /**
+     * @brief Collects stream mirrors and tickles and delivers them together every interval. Mirrors come in
+     * didReceiveMirrorPushBatch instead of didReceiveMirrorPush, and repeated tickles of the same kind cause one refresh.
+     * @param enabled
+     */
+    void setStreamBatchingEnabled(bool enabled);
+    /**
+     * @brief 0 delivers a batch once per event loop iteration
+     * @param msecs
+     */
+    void setStreamBatchInterval(int msecs);
+    void setStreamQueueLimit(int count);
+    void setStreamOverflowPolicy(STREAM_OVERFLOW_POLICY policy);
+    int getStreamQueueDepth() const;
+
     /**
      * @brief registerForRealTimeEventStream to be notified about new pushes/devices and mobile notifications
      */
     void registerForRealTimeEventStream();
 
     QNetworkAccessManager::NetworkAccessibility getNetworkAccessibility();
+    static QString getOperationName(CURRENT_OPERATION operation);
+    /**
+     * @brief Returns a snapshot of the request, parse, queue and stream metrics. Use
+     * QPushbulletMetrics::toPrometheusText() to export it.
+     * @return
+     */
+    QPushbulletMetrics getMetrics() const;
+    QNetworkAccessManager *getNetworkManager();
+
+    /**
+     * @brief Points the handler to another API server, e.g. QPushbulletMockServer. The default is
+     * https://api.pushbullet.com/v2
+     * @param baseURL
+     */
+    void setAPIBaseURL(QUrl baseURL);
+    /**
+     * @brief Records every reply and stream message to the recorder. The API key is redacted from the trace. Pass
+     * nullptr to stop recording.
+     * @param recorder
+     */
+    void setTraceRecorder(QPushbulletTraceRecorder *recorder);
+    /**
+     * @brief The API key is appended to this URL when the stream is opened. The default is
+     * wss://stream.pushbullet.com/websocket/
+     * @param baseURL
+     */
+    void setStreamBaseURL(QUrl baseURL);
+
+    /**
+     * @brief Opens the TCP and TLS connection to the API server before the first request needs it
+     */
+    void prewarmConnection();
+    /**
+     * @brief If enabled, the connection is pre-warmed right away and again whenever the network becomes accessible
+     * @param enabled
+     */
+    void setConnectionPrewarmEnabled(bool enabled);
+    /**
+     * @brief Allows HTTP/2 so concurrent API calls are multiplexed on one connection. Requires Qt 5.8 or later.
+     * @param enabled
+     */
+    void setHttp2Enabled(bool enabled);
+    /**
+     * @brief Enables TLS session persistence so the session can be resumed with a ticket
+     * @param enabled
+     */
+    void setTlsSessionReuseEnabled(bool enabled);
+    void setTlsSessionTicket(const QByteArray &ticket);
+    QByteArray getTlsSessionTicket() const;
+    /**
+     * @brief Returns the number of requests that are sent but not yet finished
+     * @return
+     */
+    int getPendingRequestCount() const;
+    bool isRealTimeEventStreamOpen() const;
+    /**
+     * @brief Returns an estimate of the heap and object memory used by this handler, including the local lists
+     * @return
+     */
+    qint64 getApproximateMemoryUsage() const;
     /**
      * @brief Returns the local DeviceList without any requests to the server
      * @return
@@ -0,0 +1,5 @@
+#include "QPushbulletLogging.h"
+
+Q_LOGGING_CATEGORY(lcPushbulletNetwork, "pushbullet.network", QtWarningMsg)
+Q_LOGGING_CATEGORY(lcPushbulletStream, "pushbullet.stream", QtWarningMsg)
+Q_LOGGING_CATEGORY(lcPushbulletTools, "pushbullet.tools", QtWarningMsg)
@@ -0,0 +1,10 @@
+#ifndef PUSHBULLETLOGGING_H
+#define PUSHBULLETLOGGING_H
+#include <QLoggingCategory>
+
+//Disabled categories cost one flag check per message. Enable them with e.g. QT_LOGGING_RULES="pushbullet.*.debug=true"
+Q_DECLARE_LOGGING_CATEGORY(lcPushbulletNetwork)
+Q_DECLARE_LOGGING_CATEGORY(lcPushbulletStream)
+Q_DECLARE_LOGGING_CATEGORY(lcPushbulletTools)
+
+#endif // PUSHBULLETLOGGING_H
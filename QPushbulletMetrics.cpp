@@ -0,0 +1,231 @@
+#include "QPushbulletMetrics.h"
+
+const QVector<qint64> &LatencyHistogram::getBounds()
+{
+    static const QVector<qint64> bounds = {1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+                                           5000000, 10000000
+                                          };
+    return bounds;
+}
+
+void LatencyHistogram::observe(qint64 usecs)
+{
+    const QVector<qint64> &bounds = getBounds();
+    int index = 0;
+    while (index < bounds.count() && usecs > bounds.at(index))
+        index++;
+    buckets[index]++;
+    count++;
+    sum += usecs;
+}
+
+QPushbulletMetrics::QPushbulletMetrics()
+    : m_WebSocketConnects(0)
+    , m_StreamMessages(0)
+    , m_Tickles(0)
+    , m_StreamDropped(0)
+    , m_StreamCoalesced(0)
+{
+}
+
+void QPushbulletMetrics::recordRequest(const QString &operation, qint64 bytesOut)
+{
+    OperationMetrics &metrics = m_Operations[operation];
+    metrics.requests++;
+    metrics.bytesOut += bytesOut;
+}
+
+void QPushbulletMetrics::recordReply(const QString &operation, bool error, qint64 bytesIn, qint64 latencyUsecs)
+{
+    OperationMetrics &metrics = m_Operations[operation];
+    if (error)
+        metrics.errors++;
+    metrics.bytesIn += bytesIn;
+    if (latencyUsecs >= 0)
+        metrics.latency.observe(latencyUsecs);
+}
+
+void QPushbulletMetrics::recordParse(const QString &operation, qint64 usecs)
+{
+    m_Operations[operation].parseTime.observe(usecs);
+}
+
+void QPushbulletMetrics::recordWebSocketConnect()
+{
+    m_WebSocketConnects++;
+}
+
+void QPushbulletMetrics::recordStreamMessage(qint64 bytes, qint64 parseUsecs)
+{
+    m_StreamMessages++;
+    m_Stream.bytesIn += bytes;
+    m_Stream.parseTime.observe(parseUsecs);
+}
+
+void QPushbulletMetrics::recordTickle()
+{
+    m_Tickles++;
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    m_RecentTickles.enqueue(now);
+    while (!m_RecentTickles.isEmpty() && m_RecentTickles.head() < now - 60000)
+        m_RecentTickles.dequeue();
+}
+
+void QPushbulletMetrics::recordStreamOverflow(bool coalesced)
+{
+    if (coalesced)
+        m_StreamCoalesced++;
+    else
+        m_StreamDropped++;
+}
+
+void QPushbulletMetrics::setQueueDepth(const QString &queue, qint64 depth)
+{
+    m_QueueDepths[queue] = depth;
+}
+
+const QMap<QString, OperationMetrics> &QPushbulletMetrics::getOperations() const
+{
+    return m_Operations;
+}
+
+const QMap<QString, qint64> &QPushbulletMetrics::getQueueDepths() const
+{
+    return m_QueueDepths;
+}
+
+const OperationMetrics &QPushbulletMetrics::getStream() const
+{
+    return m_Stream;
+}
+
+quint64 QPushbulletMetrics::getWebSocketConnects() const
+{
+    return m_WebSocketConnects;
+}
+
+quint64 QPushbulletMetrics::getWebSocketReconnects() const
+{
+    return m_WebSocketConnects > 0 ? m_WebSocketConnects - 1 : 0;
+}
+
+quint64 QPushbulletMetrics::getStreamMessages() const
+{
+    return m_StreamMessages;
+}
+
+quint64 QPushbulletMetrics::getTickles() const
+{
+    return m_Tickles;
+}
+
+quint64 QPushbulletMetrics::getStreamDropped() const
+{
+    return m_StreamDropped;
+}
+
+quint64 QPushbulletMetrics::getStreamCoalesced() const
+{
+    return m_StreamCoalesced;
+}
+
+double QPushbulletMetrics::getTickleRate() const
+{
+    const qint64 since = QDateTime::currentMSecsSinceEpoch() - 60000;
+    int count = 0;
+    for (qint64 time : m_RecentTickles) {
+        if (time >= since)
+            count++;
+    }
+    return count;
+}
+
+static QString joinLabels(const QString &labels, const QString &extra)
+{
+    if (labels.isEmpty())
+        return extra.isEmpty() ? QString() : "{" + extra + "}";
+    return "{" + labels + (extra.isEmpty() ? QString() : "," + extra) + "}";
+}
+
+static void writeHistogram(QTextStream &stream, const QString &name, const QString &labels, const QString &operation,
+                           const LatencyHistogram &histogram)
+{
+    const QVector<qint64> &bounds = LatencyHistogram::getBounds();
+    const QString operationLabel = operation.isEmpty() ? QString() : QString("operation=\"%1\",").arg(operation);
+    quint64 cumulative = 0;
+    for (int i = 0; i < histogram.buckets.count(); i++) {
+        cumulative += histogram.buckets.at(i);
+        const QString le = i < bounds.count() ? QString::number(bounds.at(i) / 1000000.0) : QString("+Inf");
+        stream << name << "_bucket" << joinLabels(labels, operationLabel + QString("le=\"%1\"").arg(le)) << " "
+               << cumulative << "\n";
+    }
+    const QString sampleLabels = joinLabels(labels, operation.isEmpty() ? QString()
+                                                                        : QString("operation=\"%1\"").arg(operation));
+    stream << name << "_sum" << sampleLabels << " " << histogram.sum / 1000000.0 << "\n";
+    stream << name << "_count" << sampleLabels << " " << histogram.count << "\n";
+}
+
+QString QPushbulletMetrics::toPrometheusText(const QString &prefix, const QString &labels) const
+{
+    QString text;
+    QTextStream stream(&text);
+
+    auto header = [&stream, &prefix](const QString &name, const QString &type, const QString &help) {
+        stream << "# HELP " << prefix << "_" << name << " " << help << "\n";
+        stream << "# TYPE " << prefix << "_" << name << " " << type << "\n";
+    };
+    auto operationLabel = [&labels](const QString &operation) {
+        return joinLabels(labels, QString("operation=\"%1\"").arg(operation));
+    };
+
+    header("requests_total", "counter", "Requests sent per operation.");
+    for (auto it = m_Operations.constBegin(); it != m_Operations.constEnd(); ++it)
+        stream << prefix << "_requests_total" << operationLabel(it.key()) << " " << it.value().requests << "\n";
+
+    header("request_errors_total", "counter", "Failed replies per operation.");
+    for (auto it = m_Operations.constBegin(); it != m_Operations.constEnd(); ++it)
+        stream << prefix << "_request_errors_total" << operationLabel(it.key()) << " " << it.value().errors << "\n";
+
+    header("received_bytes_total", "counter", "Bytes received per operation.");
+    for (auto it = m_Operations.constBegin(); it != m_Operations.constEnd(); ++it)
+        stream << prefix << "_received_bytes_total" << operationLabel(it.key()) << " " << it.value().bytesIn << "\n";
+    stream << prefix << "_received_bytes_total" << operationLabel("stream") << " " << m_Stream.bytesIn << "\n";
+
+    header("sent_bytes_total", "counter", "Bytes sent per operation.");
+    for (auto it = m_Operations.constBegin(); it != m_Operations.constEnd(); ++it)
+        stream << prefix << "_sent_bytes_total" << operationLabel(it.key()) << " " << it.value().bytesOut << "\n";
+
+    header("request_duration_seconds", "histogram", "Time from sending a request to its reply.");
+    for (auto it = m_Operations.constBegin(); it != m_Operations.constEnd(); ++it)
+        writeHistogram(stream, prefix + "_request_duration_seconds", labels, it.key(), it.value().latency);
+
+    header("parse_duration_seconds", "histogram", "Time spent parsing replies and stream messages.");
+    for (auto it = m_Operations.constBegin(); it != m_Operations.constEnd(); ++it)
+        writeHistogram(stream, prefix + "_parse_duration_seconds", labels, it.key(), it.value().parseTime);
+    writeHistogram(stream, prefix + "_parse_duration_seconds", labels, "stream", m_Stream.parseTime);
+
+    header("queue_depth", "gauge", "Items waiting in the handler's queues.");
+    for (auto it = m_QueueDepths.constBegin(); it != m_QueueDepths.constEnd(); ++it) {
+        stream << prefix << "_queue_depth" << joinLabels(labels, QString("queue=\"%1\"").arg(it.key())) << " "
+               << it.value() << "\n";
+    }
+
+    header("websocket_connects_total", "counter", "Stream connections, including reconnects.");
+    stream << prefix << "_websocket_connects_total" << joinLabels(labels, QString()) << " " << m_WebSocketConnects << "\n";
+    header("websocket_reconnects_total", "counter", "Stream reconnects.");
+    stream << prefix << "_websocket_reconnects_total" << joinLabels(labels, QString()) << " "
+           << getWebSocketReconnects() << "\n";
+    header("stream_messages_total", "counter", "Messages received from the stream.");
+    stream << prefix << "_stream_messages_total" << joinLabels(labels, QString()) << " " << m_StreamMessages << "\n";
+    header("stream_dropped_total", "counter", "Mirrors dropped because the batched stream queue was full.");
+    stream << prefix << "_stream_dropped_total" << joinLabels(labels, QString()) << " " << m_StreamDropped << "\n";
+    header("stream_coalesced_total", "counter", "Mirrors replaced by a newer one of the same notification.");
+    stream << prefix << "_stream_coalesced_total" << joinLabels(labels, QString()) << " " << m_StreamCoalesced << "\n";
+    header("tickles_total", "counter", "Tickles received from the stream.");
+    stream << prefix << "_tickles_total" << joinLabels(labels, QString()) << " " << m_Tickles << "\n";
+    header("tickles_per_minute", "gauge", "Tickles received in the last minute.");
+    stream << prefix << "_tickles_per_minute" << joinLabels(labels, QString()) << " " << getTickleRate() << "\n";
+
+    stream.flush();
+    return text;
+}
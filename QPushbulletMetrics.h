@@ -0,0 +1,79 @@
+#ifndef PUSHBULLETMETRICS_H
+#define PUSHBULLETMETRICS_H
+#include <QtCore>
+
+struct LatencyHistogram {
+    //Upper bounds of the buckets in microseconds. The last bucket has no bound.
+    static const QVector<qint64> &getBounds();
+
+    QVector<quint64> buckets = QVector<quint64>(getBounds().count() + 1, 0);
+    quint64 count = 0;
+    qint64 sum = 0;
+
+    void observe(qint64 usecs);
+};
+
+struct OperationMetrics {
+    quint64 requests = 0, errors = 0;
+    qint64 bytesIn = 0, bytesOut = 0;
+    LatencyHistogram latency, parseTime;
+};
+
+/**
+ * @brief Counters, histograms and gauges collected by QPushbulletHandler. QPushbulletHandler::getMetrics() returns a
+ * copy, so a snapshot can be read or exported while the handler keeps running.
+ */
+class QPushbulletMetrics
+{
+public:
+    QPushbulletMetrics();
+
+private:
+    //Keyed by the operation name, e.g. "get_device_list"
+    QMap<QString, OperationMetrics> m_Operations;
+    QMap<QString, qint64> m_QueueDepths;
+    quint64 m_WebSocketConnects, m_StreamMessages, m_Tickles;
+    //Mirrors that didn't fit in the batched stream queue
+    quint64 m_StreamDropped, m_StreamCoalesced;
+    OperationMetrics m_Stream;
+    //Tickle times in the last minute, in msecs since epoch
+    QQueue<qint64> m_RecentTickles;
+
+public:
+    void recordRequest(const QString &operation, qint64 bytesOut);
+    /**
+     * @brief Counts a reply. A negative latency isn't observed, replayed replies have none.
+     */
+    void recordReply(const QString &operation, bool error, qint64 bytesIn, qint64 latencyUsecs);
+    void recordParse(const QString &operation, qint64 usecs);
+    void recordWebSocketConnect();
+    void recordStreamMessage(qint64 bytes, qint64 parseUsecs);
+    void recordTickle();
+    void recordStreamOverflow(bool coalesced);
+    void setQueueDepth(const QString &queue, qint64 depth);
+
+    const QMap<QString, OperationMetrics> &getOperations() const;
+    const QMap<QString, qint64> &getQueueDepths() const;
+    const OperationMetrics &getStream() const;
+    quint64 getWebSocketConnects() const;
+    quint64 getWebSocketReconnects() const;
+    quint64 getStreamMessages() const;
+    quint64 getTickles() const;
+    quint64 getStreamDropped() const;
+    quint64 getStreamCoalesced() const;
+    /**
+     * @brief Tickles per minute over the last minute
+     * @return
+     */
+    double getTickleRate() const;
+
+    /**
+     * @brief Returns the metrics in the Prometheus text exposition format
+     * @param prefix Prepended to every metric name
+     * @param labels Extra labels for every sample, e.g. account="main"
+     * @return
+     */
+    QString toPrometheusText(const QString &prefix = "pushbullet", const QString &labels = QString()) const;
+};
+
+#endif // PUSHBULLETMETRICS_H
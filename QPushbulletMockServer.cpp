@@ -0,0 +1,561 @@
+#include "QPushbulletMockServer.h"
+#include <QDebug>
+
+QPushbulletMockServer::QPushbulletMockServer(QString apiKey, QObject *parent)
+    : QObject(parent)
+    , m_APIKey(apiKey)
+    , m_HttpServer()
+    , m_StreamServer("QPushbulletMockServer", QWebSocketServer::NonSecureMode)
+    , m_NextID(0)
+    , m_Latency(0)
+    , m_RateLimit(0)
+    , m_RequestsInWindow(0)
+    , m_DeviceChanges(0)
+{
+    connect(&m_HttpServer, SIGNAL(newConnection()), this, SLOT(acceptConnection()));
+    connect(&m_StreamServer, SIGNAL(newConnection()), this, SLOT(acceptStreamConnection()));
+    connect(&m_PushTrafficTimer, SIGNAL(timeout()), this, SLOT(generatePushTraffic()));
+    connect(&m_MirrorTrafficTimer, SIGNAL(timeout()), this, SLOT(generateMirrorTraffic()));
+    connect(&m_DeviceTrafficTimer, SIGNAL(timeout()), this, SLOT(generateDeviceTraffic()));
+    connect(&m_NopTimer, SIGNAL(timeout()), this, SLOT(sendNop()));
+    m_RateWindow.start();
+}
+
+bool QPushbulletMockServer::listen(quint16 httpPort, quint16 streamPort)
+{
+    if (!m_HttpServer.listen(QHostAddress::LocalHost, httpPort))
+        return false;
+    if (!m_StreamServer.listen(QHostAddress::LocalHost, streamPort)) {
+        m_HttpServer.close();
+        return false;
+    }
+
+    //The real stream sends a nop every 30 seconds
+    m_NopTimer.start(30000);
+    return true;
+}
+
+void QPushbulletMockServer::close()
+{
+    stopTraffic();
+    m_NopTimer.stop();
+    m_HttpServer.close();
+    m_StreamServer.close();
+}
+
+QUrl QPushbulletMockServer::getAPIBaseURL() const
+{
+    return QUrl(QString("http://127.0.0.1:%1/v2").arg(m_HttpServer.serverPort()));
+}
+
+QUrl QPushbulletMockServer::getStreamBaseURL() const
+{
+    return QUrl(QString("ws://127.0.0.1:%1/websocket/").arg(m_StreamServer.serverPort()));
+}
+
+void QPushbulletMockServer::seed(int deviceCount, int contactCount, int pushCount)
+{
+    m_Devices.clear();
+    m_Contacts.clear();
+    m_Pushes.clear();
+
+    const double start = now() - pushCount;
+    for (int i = 0; i < deviceCount; i++) {
+        QJsonObject device;
+        device["iden"] = createID();
+        device["active"] = true;
+        device["nickname"] = QString("Device %1").arg(i);
+        device["manufacturer"] = "Mock";
+        device["type"] = i % 2 == 0 ? "android" : "stream";
+        device["pushable"] = true;
+        device["app_version"] = 200;
+        device["push_token"] = createID();
+        device["created"] = start;
+        device["modified"] = start;
+        m_Devices.append(device);
+    }
+
+    for (int i = 0; i < contactCount; i++) {
+        QJsonObject contact;
+        contact["iden"] = createID();
+        contact["active"] = true;
+        contact["name"] = QString("Contact %1").arg(i);
+        contact["email"] = QString("contact%1@example.com").arg(i);
+        contact["created"] = start;
+        contact["modified"] = start;
+        m_Contacts.append(contact);
+    }
+
+    static const char *types[] = {"note", "link", "list", "address", "file"};
+    m_Pushes.reserve(pushCount);
+    for (int i = 0; i < pushCount; i++) {
+        QJsonObject push;
+        const QString type = types[i % 5];
+        push["iden"] = createID();
+        push["active"] = true;
+        push["dismissed"] = false;
+        push["type"] = type;
+        push["created"] = start + i;
+        push["modified"] = start + i;
+        push["sender_email"] = "sender@example.com";
+        push["receiver_email"] = "receiver@example.com";
+        if (type == "note" || type == "link") {
+            push["title"] = QString("Push %1").arg(i);
+            push["body"] = "Lorem ipsum dolor sit amet, consectetur adipiscing elit.";
+        }
+        if (type == "link")
+            push["url"] = QString("https://example.com/%1").arg(i);
+        else if (type == "list") {
+            push["title"] = QString("List %1").arg(i);
+            push["items"] = QJsonArray({"Item 1", "Item 2", "Item 3"});
+        }
+        else if (type == "address") {
+            push["name"] = "Home";
+            push["address"] = "1 Infinite Loop";
+        }
+        else if (type == "file") {
+            push["file_name"] = QString("image%1.jpg").arg(i);
+            push["file_type"] = "image/jpeg";
+            push["file_url"] = QString("https://dl.example.com/image%1.jpg").arg(i);
+        }
+        //The API returns the newest push first
+        m_Pushes.prepend(push);
+    }
+}
+
+int QPushbulletMockServer::getPushCount() const
+{
+    return m_Pushes.count();
+}
+
+void QPushbulletMockServer::setLatency(int msecs)
+{
+    m_Latency = msecs;
+}
+
+void QPushbulletMockServer::setRateLimit(int requestsPerSecond)
+{
+    m_RateLimit = requestsPerSecond;
+}
+
+void QPushbulletMockServer::startTraffic(int pushIntervalMsecs, int mirrorIntervalMsecs, int deviceIntervalMsecs)
+{
+    if (pushIntervalMsecs > 0)
+        m_PushTrafficTimer.start(pushIntervalMsecs);
+    if (mirrorIntervalMsecs > 0)
+        m_MirrorTrafficTimer.start(mirrorIntervalMsecs);
+    if (deviceIntervalMsecs > 0)
+        m_DeviceTrafficTimer.start(deviceIntervalMsecs);
+}
+
+void QPushbulletMockServer::stopTraffic()
+{
+    m_PushTrafficTimer.stop();
+    m_MirrorTrafficTimer.stop();
+    m_DeviceTrafficTimer.stop();
+}
+
+void QPushbulletMockServer::sendMirrors(int count)
+{
+    for (int i = 0; i < count; i++)
+        generateMirrorTraffic();
+}
+
+void QPushbulletMockServer::sendDeviceChanges(int count)
+{
+    for (int i = 0; i < count; i++)
+        generateDeviceTraffic();
+}
+
+void QPushbulletMockServer::setEncryptionPassword(QString password)
+{
+    if (password.isEmpty())
+        m_Crypto.reset();
+    else
+        m_Crypto.reset(new QPushbulletCrypto(password.toUtf8(), "mockuser"));
+}
+
+void QPushbulletMockServer::acceptConnection()
+{
+    while (m_HttpServer.hasPendingConnections()) {
+        QTcpSocket *socket = m_HttpServer.nextPendingConnection();
+        m_Buffers.insert(socket, QByteArray());
+        connect(socket, SIGNAL(readyRead()), this, SLOT(readRequests()));
+        connect(socket, SIGNAL(disconnected()), this, SLOT(socketDisconnected()));
+    }
+}
+
+void QPushbulletMockServer::socketDisconnected()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    m_Buffers.remove(socket);
+    socket->deleteLater();
+}
+
+void QPushbulletMockServer::readRequests()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    QByteArray &buffer = m_Buffers[socket];
+    buffer.append(socket->readAll());
+
+    //Keep-alive connections may carry more than one request
+    HttpRequest request;
+    while (takeRequest(buffer, request)) {
+        const HttpResponse response = route(request);
+        emit didHandleRequest(request.method, request.path, response.status);
+        if (m_Latency > 0) {
+            QPointer<QTcpSocket> guard(socket);
+            QTimer::singleShot(m_Latency, this, [this, guard, response]() {
+                if (guard)
+                    writeResponse(guard, response);
+            });
+        }
+        else {
+            writeResponse(socket, response);
+        }
+        request = HttpRequest();
+    }
+}
+
+bool QPushbulletMockServer::takeRequest(QByteArray &buffer, HttpRequest &request)
+{
+    const int headerEnd = buffer.indexOf("\r\n\r\n");
+    if (headerEnd < 0)
+        return false;
+
+    const QList<QByteArray> lines = buffer.left(headerEnd).split('\n');
+    const QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+    if (requestLine.count() < 2) {
+        buffer.clear();
+        return false;
+    }
+
+    for (int i = 1; i < lines.count(); i++) {
+        const int colon = lines.at(i).indexOf(':');
+        if (colon > 0)
+            request.headers.insert(lines.at(i).left(colon).trimmed().toLower(), lines.at(i).mid(colon + 1).trimmed());
+    }
+
+    const int contentLength = request.headers.value("content-length", "0").toInt();
+    if (buffer.size() < headerEnd + 4 + contentLength)
+        return false;
+
+    request.method = requestLine.at(0);
+    const QUrl url(QString::fromUtf8(requestLine.at(1)));
+    request.path = url.path().toUtf8();
+    request.query = QUrlQuery(url);
+    request.body = buffer.mid(headerEnd + 4, contentLength);
+    buffer.remove(0, headerEnd + 4 + contentLength);
+    return true;
+}
+
+bool QPushbulletMockServer::isRateLimited()
+{
+    if (m_RateLimit <= 0)
+        return false;
+
+    if (m_RateWindow.elapsed() >= 1000) {
+        m_RateWindow.restart();
+        m_RequestsInWindow = 0;
+    }
+    m_RequestsInWindow++;
+    return m_RequestsInWindow > m_RateLimit;
+}
+
+QPushbulletMockServer::HttpResponse QPushbulletMockServer::route(const HttpRequest &request)
+{
+    HttpResponse response;
+    if (request.headers.value("access-token") != m_APIKey.toUtf8()) {
+        response.status = 401;
+        response.body = "{\"error\":{\"type\":\"invalid_request\",\"message\":\"Access token is missing or invalid.\"}}";
+        return response;
+    }
+    if (isRateLimited()) {
+        response.status = 429;
+        response.body = "{\"error\":{\"type\":\"invalid_request\",\"message\":\"Too many requests.\"}}";
+        return response;
+    }
+
+    const QString path = QString::fromUtf8(request.path);
+    const QString pushPrefix = "/v2/pushes/";
+    if (request.method == "GET" && path == "/v2/devices")
+        return revalidate(request, listResponse("devices", m_Devices, request.query));
+    else if (request.method == "GET" && path == "/v2/contacts")
+        return revalidate(request, listResponse("contacts", m_Contacts, request.query));
+    else if (request.method == "GET" && path == "/v2/pushes")
+        return listResponse("pushes", m_Pushes, request.query);
+    else if (request.method == "POST" && path == "/v2/pushes")
+        return createPush(request.body);
+    else if (request.method == "POST" && path.startsWith(pushPrefix))
+        return updatePush(path.mid(pushPrefix.length()), request.body);
+    else if (request.method == "DELETE" && path.startsWith(pushPrefix))
+        return deletePush(path.mid(pushPrefix.length()));
+    else if (request.method == "DELETE" && path == "/v2/pushes") {
+        m_Pushes.clear();
+        sendTickle("push");
+        response.body = "{}";
+        return response;
+    }
+    else if (request.method == "POST" && path == "/v2/ephemerals") {
+        broadcast(QJsonDocument::fromJson(request.body).object());
+        response.body = "{}";
+        return response;
+    }
+    else if (request.method == "GET" && path == "/v2/users/me") {
+        response.body = "{\"iden\":\"mockuser\",\"email\":\"mock@example.com\",\"name\":\"Mock User\"}";
+        return response;
+    }
+
+    response.status = 404;
+    response.body = "{\"error\":{\"type\":\"invalid_request\",\"message\":\"Not found.\"}}";
+    return response;
+}
+
+QPushbulletMockServer::HttpResponse QPushbulletMockServer::listResponse(const QString &name,
+                                                                        const QList<QJsonObject> &items,
+                                                                        const QUrlQuery &query)
+{
+    const bool hasModifiedAfter = query.hasQueryItem("modified_after");
+    const double modifiedAfter = query.queryItemValue("modified_after").toDouble();
+
+    //Written by hand instead of building one big QJsonArray, so histories with a million pushes stay cheap to serve
+    HttpResponse response;
+    response.body.reserve(items.count() * 256);
+    response.body.append("{\"").append(name.toUtf8()).append("\":[");
+    bool first = true;
+    for (const QJsonObject &item : items) {
+        if (hasModifiedAfter && item["modified"].toDouble() <= modifiedAfter)
+            continue;
+        if (!first)
+            response.body.append(',');
+        response.body.append(QJsonDocument(item).toJson(QJsonDocument::Compact));
+        first = false;
+    }
+    response.body.append("]}");
+    return response;
+}
+
+QPushbulletMockServer::HttpResponse QPushbulletMockServer::revalidate(const HttpRequest &request,
+                                                                      HttpResponse response)
+{
+    //Only full lists have a validator, deltas are answered in full
+    if (request.query.hasQueryItem("modified_after"))
+        return response;
+
+    response.etag = '"' + QCryptographicHash::hash(response.body, QCryptographicHash::Sha1).toHex() + '"';
+    if (request.headers.value("if-none-match") == response.etag) {
+        response.status = 304;
+        response.body.clear();
+    }
+    return response;
+}
+
+QPushbulletMockServer::HttpResponse QPushbulletMockServer::createPush(const QByteArray &body)
+{
+    QJsonObject push = QJsonDocument::fromJson(body).object();
+    push["iden"] = createID();
+    push["active"] = true;
+    push["dismissed"] = false;
+    push["created"] = now();
+    push["modified"] = now();
+    push["sender_email"] = "mock@example.com";
+    m_Pushes.prepend(push);
+    sendTickle("push");
+
+    HttpResponse response;
+    response.body = QJsonDocument(push).toJson(QJsonDocument::Compact);
+    return response;
+}
+
+QPushbulletMockServer::HttpResponse QPushbulletMockServer::updatePush(const QString &pushID, const QByteArray &body)
+{
+    HttpResponse response;
+    for (QJsonObject &push : m_Pushes) {
+        if (push["iden"].toString() != pushID)
+            continue;
+
+        const QJsonObject changes = QJsonDocument::fromJson(body).object();
+        for (auto it = changes.begin(); it != changes.end(); ++it)
+            push[it.key()] = it.value();
+        push["modified"] = now();
+        sendTickle("push");
+        response.body = QJsonDocument(push).toJson(QJsonDocument::Compact);
+        return response;
+    }
+
+    response.status = 404;
+    response.body = "{\"error\":{\"type\":\"invalid_request\",\"message\":\"Object not found.\"}}";
+    return response;
+}
+
+QPushbulletMockServer::HttpResponse QPushbulletMockServer::deletePush(const QString &pushID)
+{
+    HttpResponse response;
+    for (int i = 0; i < m_Pushes.count(); i++) {
+        if (m_Pushes.at(i)["iden"].toString() == pushID) {
+            m_Pushes.removeAt(i);
+            sendTickle("push");
+            response.body = "{}";
+            return response;
+        }
+    }
+
+    response.status = 404;
+    response.body = "{\"error\":{\"type\":\"invalid_request\",\"message\":\"Object not found.\"}}";
+    return response;
+}
+
+void QPushbulletMockServer::writeResponse(QTcpSocket *socket, const HttpResponse &response)
+{
+    QByteArray reason = "OK";
+    if (response.status == 401)
+        reason = "Unauthorized";
+    else if (response.status == 304)
+        reason = "Not Modified";
+    else if (response.status == 404)
+        reason = "Not Found";
+    else if (response.status == 429)
+        reason = "Too Many Requests";
+
+    QByteArray data;
+    data.reserve(response.body.size() + 128);
+    data.append("HTTP/1.1 ").append(QByteArray::number(response.status)).append(' ').append(reason).append("\r\n");
+    data.append("Content-Type: application/json\r\n");
+    data.append("Content-Length: ").append(QByteArray::number(response.body.size())).append("\r\n");
+    if (!response.etag.isEmpty())
+        data.append("ETag: ").append(response.etag).append("\r\n");
+    data.append("Connection: keep-alive\r\n\r\n");
+    data.append(response.body);
+    socket->write(data);
+}
+
+void QPushbulletMockServer::acceptStreamConnection()
+{
+    while (m_StreamServer.hasPendingConnections()) {
+        QWebSocket *socket = m_StreamServer.nextPendingConnection();
+        if (socket->requestUrl().path() != "/websocket/" + m_APIKey) {
+            socket->close(QWebSocketProtocol::CloseCodePolicyViolated);
+            socket->deleteLater();
+            continue;
+        }
+
+        m_StreamClients.append(socket);
+        connect(socket, SIGNAL(disconnected()), this, SLOT(streamDisconnected()));
+    }
+}
+
+void QPushbulletMockServer::streamDisconnected()
+{
+    QWebSocket *socket = qobject_cast<QWebSocket *>(sender());
+    m_StreamClients.removeAll(socket);
+    socket->deleteLater();
+}
+
+void QPushbulletMockServer::generatePushTraffic()
+{
+    QJsonObject push;
+    push["type"] = "note";
+    push["title"] = "Generated";
+    push["body"] = QString("Generated at %1").arg(now(), 0, 'f', 3);
+    createPush(QJsonDocument(push).toJson(QJsonDocument::Compact));
+}
+
+void QPushbulletMockServer::generateMirrorTraffic()
+{
+    QJsonObject mirror;
+    mirror["type"] = "mirror";
+    mirror["title"] = "New message";
+    mirror["body"] = "Are we still on for lunch?";
+    mirror["application_name"] = "Messages";
+    mirror["package_name"] = "com.example.messages";
+    mirror["notification_id"] = QString::number(m_NextID % 16);
+    mirror["notification_tag"] = QJsonValue();
+    mirror["source_device_iden"] = m_Devices.isEmpty() ? "mockdevice" : m_Devices.first()["iden"].toString();
+    mirror["source_user_iden"] = "mockuser";
+    mirror["dismissible"] = true;
+    //A small but realistic base64 icon
+    mirror["icon"] = QString(QByteArray(2048, 'A').toBase64());
+
+    QJsonObject message;
+    message["type"] = "push";
+    if (m_Crypto) {
+        QJsonObject encrypted;
+        encrypted["encrypted"] = true;
+        const QByteArray plaintext = QJsonDocument(mirror).toJson(QJsonDocument::Compact);
+        encrypted["ciphertext"] = QString::fromLatin1(m_Crypto->encrypt(plaintext));
+        message["push"] = encrypted;
+    }
+    else {
+        message["push"] = mirror;
+    }
+    createID();
+    broadcast(message);
+}
+
+void QPushbulletMockServer::generateDeviceTraffic()
+{
+    const double modified = now();
+    const int change = m_DeviceChanges++;
+    if (m_Devices.isEmpty() || change % 10 == 9) {
+        QJsonObject device;
+        device["iden"] = createID();
+        device["active"] = true;
+        device["manufacturer"] = "Mock";
+        device["type"] = "stream";
+        device["pushable"] = true;
+        device["app_version"] = 200;
+        device["push_token"] = createID();
+        device["created"] = modified;
+        m_Devices.append(device);
+    }
+    QJsonObject &device = m_Devices[change % m_Devices.count()];
+    device["nickname"] = QString("Device %1").arg(change);
+    device["modified"] = modified;
+
+    if (m_Contacts.isEmpty() || change % 10 == 9) {
+        QJsonObject contact;
+        contact["iden"] = createID();
+        contact["active"] = true;
+        contact["email"] = QString("contact%1@example.com").arg(m_NextID);
+        contact["created"] = modified;
+        m_Contacts.append(contact);
+    }
+    QJsonObject &contact = m_Contacts[change % m_Contacts.count()];
+    contact["name"] = QString("Contact %1").arg(change);
+    contact["modified"] = modified;
+
+    //Announced with a device tickle, which the handler answers with a modified_after delta
+    sendTickle("device");
+}
+
+void QPushbulletMockServer::sendNop()
+{
+    QJsonObject message;
+    message["type"] = "nop";
+    broadcast(message);
+}
+
+void QPushbulletMockServer::sendTickle(const QString &subtype)
+{
+    QJsonObject message;
+    message["type"] = "tickle";
+    message["subtype"] = subtype;
+    broadcast(message);
+}
+
+void QPushbulletMockServer::broadcast(const QJsonObject &message)
+{
+    const QString text = QString::fromUtf8(QJsonDocument(message).toJson(QJsonDocument::Compact));
+    for (QWebSocket *socket : m_StreamClients)
+        socket->sendTextMessage(text);
+}
+
+QString QPushbulletMockServer::createID()
+{
+    return QString("mock%1").arg(++m_NextID, 18, 10, QChar('0'));
+}
+
+double QPushbulletMockServer::now() const
+{
+    return QDateTime::currentMSecsSinceEpoch() / 1000.0;
+}
@@ -0,0 +1,133 @@
+#ifndef PUSHBULLETMOCKSERVER_H
+#define PUSHBULLETMOCKSERVER_H
+#include <QObject>
+#include <QtNetwork>
+#include <QtWebSockets>
+#include "QPushbulletCrypto.h"
+
+/**
+ * @brief A local stand-in for the Pushbullet API and stream servers. It serves devices, contacts and pushes from memory
+ * over plain HTTP and sends tickles and mirrors over a QWebSocketServer, so QPushbulletHandler can be measured without
+ * the network. Point the handler to it with setAPIBaseURL(getAPIBaseURL()) and setStreamBaseURL(getStreamBaseURL()).
+ */
+class QPushbulletMockServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    QPushbulletMockServer(QString apiKey, QObject *parent = nullptr);
+
+private:
+    struct HttpRequest {
+        QByteArray method, path, body;
+        QUrlQuery query;
+        QHash<QByteArray, QByteArray> headers;
+    };
+
+    struct HttpResponse {
+        int status = 200;
+        QByteArray body, etag;
+    };
+
+    const QString m_APIKey;
+    QTcpServer m_HttpServer;
+    QWebSocketServer m_StreamServer;
+    QHash<QTcpSocket *, QByteArray> m_Buffers;
+    QList<QWebSocket *> m_StreamClients;
+
+    QList<QJsonObject> m_Devices, m_Contacts, m_Pushes;
+    qint64 m_NextID;
+
+    int m_Latency, m_RateLimit, m_RequestsInWindow;
+    QElapsedTimer m_RateWindow;
+
+    QTimer m_PushTrafficTimer, m_MirrorTrafficTimer, m_DeviceTrafficTimer, m_NopTimer;
+    int m_DeviceChanges;
+    QPushbulletCryptoPointer m_Crypto;
+
+signals:
+    void didHandleRequest(const QByteArray &method, const QByteArray &path, int status);
+
+private slots:
+    void acceptConnection();
+    void readRequests();
+    void socketDisconnected();
+    void acceptStreamConnection();
+    void streamDisconnected();
+    void generatePushTraffic();
+    void generateMirrorTraffic();
+    void generateDeviceTraffic();
+    void sendNop();
+
+private:
+    bool takeRequest(QByteArray &buffer, HttpRequest &request);
+    HttpResponse route(const HttpRequest &request);
+    void writeResponse(QTcpSocket *socket, const HttpResponse &response);
+    bool isRateLimited();
+
+    HttpResponse listResponse(const QString &name, const QList<QJsonObject> &items, const QUrlQuery &query);
+    HttpResponse revalidate(const HttpRequest &request, HttpResponse response);
+    HttpResponse createPush(const QByteArray &body);
+    HttpResponse updatePush(const QString &pushID, const QByteArray &body);
+    HttpResponse deletePush(const QString &pushID);
+
+    QString createID();
+    double now() const;
+    void broadcast(const QJsonObject &message);
+    void sendTickle(const QString &subtype);
+
+public:
+    /**
+     * @brief Listens on the loopback interface. Use 0 to get any free port.
+     * @param httpPort
+     * @param streamPort
+     * @return
+     */
+    bool listen(quint16 httpPort = 0, quint16 streamPort = 0);
+    void close();
+    QUrl getAPIBaseURL() const;
+    QUrl getStreamBaseURL() const;
+
+    /**
+     * @brief Fills the server with generated data. The pushes are a mix of all push types with increasing timestamps.
+     */
+    void seed(int deviceCount, int contactCount, int pushCount);
+    int getPushCount() const;
+
+    /**
+     * @brief Delays every response by the given time
+     * @param msecs
+     */
+    void setLatency(int msecs);
+    /**
+     * @brief Requests above this count in a second get 429 Too Many Requests. 0 disables the limit.
+     * @param requestsPerSecond
+     */
+    void setRateLimit(int requestsPerSecond);
+
+    /**
+     * @brief Creates a push and sends a push tickle every pushIntervalMsecs, a mirror every mirrorIntervalMsecs, and
+     * changes a device and a contact and sends a device tickle every deviceIntervalMsecs, like a busy account does. Use
+     * 0 to disable any of them.
+     */
+    void startTraffic(int pushIntervalMsecs, int mirrorIntervalMsecs, int deviceIntervalMsecs = 0);
+    void stopTraffic();
+    /**
+     * @brief Sends count mirrors to the stream clients at once
+     * @param count
+     */
+    void sendMirrors(int count);
+    /**
+     * @brief Renames a device and a contact, adding one every tenth change, and sends a device tickle, count times
+     * @param count
+     */
+    void sendDeviceChanges(int count);
+    /**
+     * @brief Encrypts the generated mirrors with the key of this password, salted with the mock user iden. An empty
+     * password sends them in the clear again.
+     * @param password
+     */
+    void setEncryptionPassword(QString password);
+};
+
+#endif // PUSHBULLETMOCKSERVER_H
@@ -0,0 +1,185 @@
+#include "QPushbulletPool.h"
+#include <QDebug>
+
+QPushbulletPool::QPushbulletPool(QObject *parent)
+    : QObject(parent)
+    , m_NetworkManager()
+    , m_NextHandlerIndex(0)
+    , m_MaxConcurrentRequests(6)
+{
+    connect(&m_StreamTimer, SIGNAL(timeout()), this, SLOT(openNextStream()));
+}
+
+QPushbulletPool::~QPushbulletPool()
+{
+    //The handlers must go before the shared QNetworkAccessManager member
+    const QList<QPushbulletHandler *> handlers = m_HandlerOrder;
+    m_HandlerOrder.clear();
+    m_Handlers.clear();
+    qDeleteAll(handlers);
+}
+
+QPushbulletHandler *QPushbulletPool::addAccount(QString apiKey)
+{
+    if (m_Handlers.contains(apiKey))
+        return m_Handlers.value(apiKey);
+
+    QPushbulletHandler *handler = new QPushbulletHandler(apiKey, &m_NetworkManager);
+    handler->setParent(this);
+    m_Handlers.insert(apiKey, handler);
+    m_HandlerOrder.append(handler);
+
+    connect(handler, SIGNAL(didFinishRequest()), this, SLOT(dispatchRequests()));
+    connect(handler, SIGNAL(didReceiveMirrorPush(MirrorPush)), this, SLOT(relayMirrorPush(MirrorPush)));
+    connect(handler, SIGNAL(didReceiveMirrorPushBatch(MirrorPushList)), this,
+            SLOT(relayMirrorPushBatch(MirrorPushList)));
+    connect(handler, SIGNAL(destroyed(QObject *)), this, SLOT(handlerDestroyed(QObject *)));
+    return handler;
+}
+
+void QPushbulletPool::removeAccount(QString apiKey)
+{
+    QPushbulletHandler *handler = m_Handlers.take(apiKey);
+    if (!handler)
+        return;
+
+    handlerDestroyed(handler);
+    handler->deleteLater();
+}
+
+QPushbulletHandler *QPushbulletPool::getHandler(QString apiKey)
+{
+    return m_Handlers.value(apiKey, nullptr);
+}
+
+const QList<QPushbulletHandler *> QPushbulletPool::getHandlers()
+{
+    return m_HandlerOrder;
+}
+
+void QPushbulletPool::schedule(QString apiKey, PoolRequest request)
+{
+    QPushbulletHandler *handler = addAccount(apiKey);
+    m_Queues[handler].enqueue(request);
+    dispatchRequests();
+}
+
+void QPushbulletPool::setMaxConcurrentRequests(int count)
+{
+    m_MaxConcurrentRequests = qMax(1, count);
+    dispatchRequests();
+}
+
+int QPushbulletPool::getMaxConcurrentRequests() const
+{
+    return m_MaxConcurrentRequests;
+}
+
+void QPushbulletPool::dispatchRequests()
+{
+    if (m_HandlerOrder.isEmpty())
+        return;
+
+    int inFlight = getInFlightRequestCount();
+    int idleTurns = 0;
+    //Walk the accounts starting from the one after the last served account. Stop when the limit is reached or a full
+    //round didn't find anything to send.
+    while (inFlight < m_MaxConcurrentRequests && idleTurns < m_HandlerOrder.count()) {
+        m_NextHandlerIndex %= m_HandlerOrder.count();
+        QPushbulletHandler *handler = m_HandlerOrder.at(m_NextHandlerIndex);
+        m_NextHandlerIndex++;
+
+        QQueue<PoolRequest> &queue = m_Queues[handler];
+        if (queue.isEmpty() || handler->getPendingRequestCount() > 0) {
+            idleTurns++;
+            continue;
+        }
+
+        idleTurns = 0;
+        PoolRequest request = queue.dequeue();
+        const int pendingBefore = handler->getPendingRequestCount();
+        request(handler);
+        inFlight += handler->getPendingRequestCount() - pendingBefore;
+    }
+}
+
+void QPushbulletPool::registerForRealTimeEventStreams(int intervalMsecs)
+{
+    m_StreamsToOpen.clear();
+    for (QPushbulletHandler *handler : m_HandlerOrder) {
+        if (!handler->isRealTimeEventStreamOpen())
+            m_StreamsToOpen.append(handler);
+    }
+
+    m_StreamTimer.start(intervalMsecs);
+    openNextStream();
+}
+
+void QPushbulletPool::openNextStream()
+{
+    if (m_StreamsToOpen.isEmpty()) {
+        m_StreamTimer.stop();
+        return;
+    }
+
+    m_StreamsToOpen.takeFirst()->registerForRealTimeEventStream();
+}
+
+void QPushbulletPool::relayMirrorPush(const MirrorPush &mirror)
+{
+    QPushbulletHandler *handler = qobject_cast<QPushbulletHandler *>(sender());
+    if (handler)
+        emit didReceiveMirrorPush(handler, mirror);
+}
+
+void QPushbulletPool::relayMirrorPushBatch(const MirrorPushList &mirrors)
+{
+    QPushbulletHandler *handler = qobject_cast<QPushbulletHandler *>(sender());
+    if (handler)
+        emit didReceiveMirrorPushBatch(handler, mirrors);
+}
+
+void QPushbulletPool::handlerDestroyed(QObject *handler)
+{
+    //Called for both removeAccount() and handlers deleted by the user, so only pointer comparisons are safe here
+    QPushbulletHandler *h = static_cast<QPushbulletHandler *>(handler);
+    m_HandlerOrder.removeAll(h);
+    m_Queues.remove(h);
+    m_StreamsToOpen.removeAll(h);
+    for (auto it = m_Handlers.begin(); it != m_Handlers.end();) {
+        if (it.value() == h)
+            it = m_Handlers.erase(it);
+        else
+            ++it;
+    }
+}
+
+int QPushbulletPool::getInFlightRequestCount() const
+{
+    int count = 0;
+    for (QPushbulletHandler *handler : m_HandlerOrder)
+        count += handler->getPendingRequestCount();
+    return count;
+}
+
+PoolResourceUsage QPushbulletPool::getResourceUsage() const
+{
+    PoolResourceUsage usage;
+    usage.accountCount = m_HandlerOrder.count();
+    usage.memoryUsage = sizeof(QPushbulletPool);
+    for (QPushbulletHandler *handler : m_HandlerOrder) {
+        if (handler->isRealTimeEventStreamOpen())
+            usage.openStreams++;
+        usage.pendingRequests += handler->getPendingRequestCount();
+        usage.queuedRequests += m_Queues.value(handler).count();
+        usage.memoryUsage += handler->getApproximateMemoryUsage();
+    }
+
+    if (usage.accountCount > 0)
+        usage.memoryPerAccount = (usage.memoryUsage - sizeof(QPushbulletPool)) / usage.accountCount;
+
+#ifdef Q_OS_LINUX
+    usage.openFileDescriptors = QDir("/proc/self/fd").entryList(QDir::NoDotAndDotDot | QDir::AllEntries | QDir::System).count();
+#endif
+    return usage;
+}
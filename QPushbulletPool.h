@@ -0,0 +1,87 @@
+#ifndef PUSHBULLETPOOL_H
+#define PUSHBULLETPOOL_H
+#include <QObject>
+#include <QtNetwork>
+#include <functional>
+#include "QPushbulletHandler.h"
+
+struct PoolResourceUsage {
+    int accountCount = 0, openStreams = 0, pendingRequests = 0, queuedRequests = 0;
+    qint64 memoryUsage = 0, memoryPerAccount = 0;
+    //-1 when the platform doesn't let us count them
+    int openFileDescriptors = -1;
+};
+
+typedef std::function<void(QPushbulletHandler *handler)> PoolRequest;
+
+/**
+ * @brief Hosts many accounts on one QNetworkAccessManager, so the connections and TLS sessions to Pushbullet are shared
+ * between them. Requests scheduled through the pool are sent round-robin across the accounts.
+ */
+class QPushbulletPool : public QObject
+{
+    Q_OBJECT
+
+public:
+    QPushbulletPool(QObject *parent = nullptr);
+    ~QPushbulletPool();
+
+private:
+    QNetworkAccessManager m_NetworkManager;
+    QHash<QString, QPushbulletHandler *> m_Handlers;
+    //Keeps the round-robin order stable
+    QList<QPushbulletHandler *> m_HandlerOrder;
+    QHash<QPushbulletHandler *, QQueue<PoolRequest>> m_Queues;
+    int m_NextHandlerIndex;
+    int m_MaxConcurrentRequests;
+
+    QList<QPushbulletHandler *> m_StreamsToOpen;
+    QTimer m_StreamTimer;
+
+signals:
+    void didReceiveMirrorPush(QPushbulletHandler *handler, const MirrorPush &mirror);
+    void didReceiveMirrorPushBatch(QPushbulletHandler *handler, const MirrorPushList &mirrors);
+
+private slots:
+    void dispatchRequests();
+    void openNextStream();
+    void relayMirrorPush(const MirrorPush &mirror);
+    void relayMirrorPushBatch(const MirrorPushList &mirrors);
+    void handlerDestroyed(QObject *handler);
+
+private:
+    int getInFlightRequestCount() const;
+
+public:
+    /**
+     * @brief Creates a handler for the account or returns the existing one. The pool owns the handler.
+     * @param apiKey
+     * @return
+     */
+    QPushbulletHandler *addAccount(QString apiKey);
+    void removeAccount(QString apiKey);
+    QPushbulletHandler *getHandler(QString apiKey);
+    const QList<QPushbulletHandler *> getHandlers();
+
+    /**
+     * @brief Queues the request for the account. Each account has at most one request in flight and the accounts take
+     * turns, so a busy account cannot starve the others.
+     * @param apiKey
+     * @param request Called with the account's handler when it's the account's turn, e.g.
+     * [](QPushbulletHandler *h) { h->requestDeviceList(); }
+     */
+    void schedule(QString apiKey, PoolRequest request);
+    void setMaxConcurrentRequests(int count);
+    int getMaxConcurrentRequests() const;
+
+    /**
+     * @brief Opens the real time event streams of all the accounts. Sockets are opened one at a time with the given
+     * interval so hundreds of accounts don't reconnect at the same moment.
+     * @param intervalMsecs
+     */
+    void registerForRealTimeEventStreams(int intervalMsecs = 50);
+
+    PoolResourceUsage getResourceUsage() const;
+};
+
+#endif // PUSHBULLETPOOL_H
@@ -0,0 +1,232 @@
+#include "QPushbulletPrefetcher.h"
+#include "QPushbulletLogging.h"
+#include <QDebug>
+#include <algorithm>
+
+namespace {
+
+//Stores a fresh download, or reads a cached one, then decodes and downscales it on a worker thread, so the GUI
+//thread doesn't wait for the disk. QImage, unlike QPixmap, can be used outside the GUI thread.
+class ThumbnailTask : public QRunnable
+{
+public:
+    //An empty data reads the file from the cache
+    ThumbnailTask(QObject *prefetcher, QPushbulletFileCache *cache, const QString &url, const QByteArray &data,
+                  const QSize &size)
+        : m_Prefetcher(prefetcher), m_Cache(cache), m_URL(url), m_Data(data), m_Size(size)
+    {
+    }
+
+    void run() override
+    {
+        bool stored = false;
+        if (m_Data.isEmpty())
+            m_Data = m_Cache->get(m_URL);
+        else
+            stored = m_Cache->put(m_URL, m_Data);
+
+        QImage image;
+        bool ok = !m_Data.isEmpty() && image.loadFromData(m_Data);
+        if (ok) {
+            if (image.width() > m_Size.width() || image.height() > m_Size.height())
+                image = image.scaled(m_Size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+            QByteArray thumbnail;
+            QBuffer buffer(&thumbnail);
+            buffer.open(QIODevice::WriteOnly);
+            ok = image.hasAlphaChannel() ? image.save(&buffer, "PNG") : image.save(&buffer, "JPG", 85);
+            ok = ok && m_Cache->put(QPushbulletPrefetcher::getThumbnailKey(m_URL), thumbnail);
+        }
+        QMetaObject::invokeMethod(m_Prefetcher, "handleThumbnail", Qt::QueuedConnection, Q_ARG(QString, m_URL),
+                                  Q_ARG(bool, stored), Q_ARG(bool, ok));
+    }
+
+private:
+    QObject *m_Prefetcher;
+    QPushbulletFileCache *m_Cache;
+    QString m_URL;
+    QByteArray m_Data;
+    QSize m_Size;
+};
+
+}
+
+QPushbulletPrefetcher::QPushbulletPrefetcher(QPushbulletHandler *handler, QPushbulletFileCache *cache, QObject *parent)
+    : QObject(parent)
+    , m_Handler(handler)
+    , m_Cache(cache)
+    , m_MaxConcurrentDownloads(2)
+    , m_MaxCount(50)
+    , m_MaxBytes(50 * 1024 * 1024)
+    , m_BytesUsed(0)
+    , m_BytesReserved(0)
+    , m_BudgetWindow(24 * 60 * 60 * 1000)
+    , m_ThumbnailSize(256, 256)
+{
+    m_BudgetStarted.start();
+    m_ThumbnailPool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+    connect(m_Handler, SIGNAL(didReceivePushHistory(PushList)), this, SLOT(pushHistoryReceived(PushList)));
+}
+
+QPushbulletPrefetcher::~QPushbulletPrefetcher()
+{
+    for (QNetworkReply *reply : m_Downloads.keys()) {
+        reply->disconnect(this);
+        reply->abort();
+        reply->deleteLater();
+    }
+    m_ThumbnailPool.waitForDone();
+}
+
+QString QPushbulletPrefetcher::getThumbnailKey(const QString &url)
+{
+    return "thumbnail:" + url;
+}
+
+QImage QPushbulletPrefetcher::getThumbnail(const QString &url)
+{
+    return QImage::fromData(m_Cache->get(getThumbnailKey(url)));
+}
+
+void QPushbulletPrefetcher::pushHistoryReceived(const PushList &pushes)
+{
+    PushList images;
+    for (const Push &push : pushes) {
+        if (push.type == PUSH_TYPE::FILE && push.fileType.startsWith("image/") && !push.fileURL.isEmpty())
+            images.append(push);
+    }
+    std::sort(images.begin(), images.end(), [](const Push & a, const Push & b) {
+        return a.created > b.created;
+    });
+
+    //A new history replaces what was queued for the previous one. The byte budget is kept, this is emitted for every
+    //tickle and local change too.
+    restartBudgetIfExpired();
+    m_Queue.clear();
+    QSet<QString> downloading;
+    for (const Download &download : m_Downloads)
+        downloading.insert(download.url);
+    for (int i = 0; i < images.count() && i < m_MaxCount; i++) {
+        const QString &url = images.at(i).fileURL;
+        if (m_Rejected.contains(url) || m_Thumbnailing.contains(url) || downloading.contains(url) ||
+                m_Cache->contains(getThumbnailKey(url)))
+            continue;
+
+        //Only the index is looked at here, the file is read by the thumbnail task
+        if (m_Cache->contains(url))
+            startThumbnail(url);
+        else
+            m_Queue.append(url);
+    }
+    downloadNext();
+}
+
+void QPushbulletPrefetcher::restartBudgetIfExpired()
+{
+    if (!m_BudgetStarted.hasExpired(m_BudgetWindow))
+        return;
+
+    m_BudgetStarted.restart();
+    m_BytesUsed = 0;
+    m_Rejected.clear();
+}
+
+void QPushbulletPrefetcher::downloadNext()
+{
+    restartBudgetIfExpired();
+    while (!m_Queue.isEmpty() && m_Downloads.count() < m_MaxConcurrentDownloads &&
+           m_BytesUsed + m_BytesReserved < m_MaxBytes) {
+        Download download;
+        download.url = m_Queue.takeFirst();
+        //Files are served from another host, so the Access-Token isn't sent with them
+        QNetworkReply *reply = m_Handler->getNetworkManager()->get(QNetworkRequest(QUrl(download.url)));
+        m_Downloads.insert(reply, download);
+        connect(reply, SIGNAL(downloadProgress(qint64,qint64)), this, SLOT(downloadProgress(qint64,qint64)));
+        connect(reply, SIGNAL(finished()), this, SLOT(downloadFinished()));
+    }
+}
+
+void QPushbulletPrefetcher::downloadProgress(qint64 bytesReceived, qint64 bytesTotal)
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    auto foundIt = m_Downloads.find(reply);
+    if (foundIt == m_Downloads.end())
+        return;
+
+    //The other downloads in flight keep what they reserved, so parallel downloads can't overrun the budget together
+    Download &download = foundIt.value();
+    const qint64 reservation = qMax(bytesReceived, bytesTotal);
+    const qint64 available = m_MaxBytes - m_BytesUsed - (m_BytesReserved - download.reserved);
+    if (reservation > available) {
+        qCDebug(lcPushbulletTools) << "Prefetch over the budget, skipped" << reply->url().path();
+        m_Rejected.insert(download.url);
+        reply->abort();
+        return;
+    }
+    m_BytesReserved += reservation - download.reserved;
+    download.reserved = reservation;
+}
+
+void QPushbulletPrefetcher::downloadFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    const Download download = m_Downloads.take(reply);
+    const QString &url = download.url;
+    m_BytesReserved -= download.reserved;
+    reply->deleteLater();
+
+    if (reply->error()) {
+        if (reply->error() != QNetworkReply::OperationCanceledError)
+            qCWarning(lcPushbulletTools) << "Prefetch failed:" << reply->errorString();
+    }
+    else {
+        const QByteArray data = reply->readAll();
+        m_BytesUsed += data.size();
+        //Stored by the thumbnail task, didPrefetchFile() is emitted once it's in the cache
+        startThumbnail(url, data);
+    }
+    downloadNext();
+}
+
+void QPushbulletPrefetcher::startThumbnail(const QString &url, const QByteArray &data)
+{
+    m_Thumbnailing.insert(url);
+    m_ThumbnailPool.start(new ThumbnailTask(this, m_Cache, url, data, m_ThumbnailSize));
+}
+
+void QPushbulletPrefetcher::handleThumbnail(QString url, bool stored, bool ok)
+{
+    m_Thumbnailing.remove(url);
+    if (stored)
+        emit didPrefetchFile(url);
+    if (ok)
+        emit didPrefetchThumbnail(url);
+    else
+        qCWarning(lcPushbulletTools) << "Couldn't create a thumbnail for" << QUrl(url).path();
+}
+
+void QPushbulletPrefetcher::setMaxConcurrentDownloads(int count)
+{
+    m_MaxConcurrentDownloads = qMax(1, count);
+    downloadNext();
+}
+
+void QPushbulletPrefetcher::setMaxCount(int count)
+{
+    m_MaxCount = qMax(0, count);
+}
+
+void QPushbulletPrefetcher::setMaxBytes(qint64 bytes)
+{
+    m_MaxBytes = bytes;
+}
+
+void QPushbulletPrefetcher::setBudgetWindow(qint64 msecs)
+{
+    m_BudgetWindow = msecs;
+}
+
+void QPushbulletPrefetcher::setThumbnailSize(QSize size)
+{
+    m_ThumbnailSize = size;
+}
@@ -0,0 +1,87 @@
+#ifndef PUSHBULLETPREFETCHER_H
+#define PUSHBULLETPREFETCHER_H
+#include <QObject>
+#include <QImage>
+#include "QPushbulletHandler.h"
+#include "QPushbulletFileCache.h"
+
+/**
+ * @brief Downloads the images of the newest file pushes as the push history arrives, and stores them with downscaled
+ * thumbnails in a QPushbulletFileCache. Give the same cache to QPushbulletHandler::setFileCache() so
+ * requestFileDownload() is served from it.
+ */
+class QPushbulletPrefetcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    QPushbulletPrefetcher(QPushbulletHandler *handler, QPushbulletFileCache *cache, QObject *parent = nullptr);
+    ~QPushbulletPrefetcher();
+
+private:
+    struct Download {
+        QString url;
+        //Bytes held back from the budget, the announced size or what arrived so far
+        qint64 reserved = 0;
+    };
+
+    QPushbulletHandler *m_Handler;
+    QPushbulletFileCache *m_Cache;
+    //Newest first
+    QStringList m_Queue;
+    QHash<QNetworkReply *, Download> m_Downloads;
+    QSet<QString> m_Thumbnailing;
+    //Files that didn't fit the budget, not tried again until the budget window restarts
+    QSet<QString> m_Rejected;
+    int m_MaxConcurrentDownloads, m_MaxCount;
+    qint64 m_MaxBytes, m_BytesUsed, m_BytesReserved;
+    qint64 m_BudgetWindow;
+    QElapsedTimer m_BudgetStarted;
+    QSize m_ThumbnailSize;
+    QThreadPool m_ThumbnailPool;
+
+signals:
+    void didPrefetchFile(const QString &url);
+    void didPrefetchThumbnail(const QString &url);
+
+private slots:
+    void pushHistoryReceived(const PushList &pushes);
+    void downloadNext();
+    void downloadFinished();
+    void downloadProgress(qint64 bytesReceived, qint64 bytesTotal);
+    void handleThumbnail(QString url, bool stored, bool ok);
+
+private:
+    void startThumbnail(const QString &url, const QByteArray &data = QByteArray());
+    void restartBudgetIfExpired();
+
+public:
+    static QString getThumbnailKey(const QString &url);
+    /**
+     * @brief Returns the cached thumbnail, or a null image if it isn't prefetched (yet)
+     * @param url The fileURL of the push
+     * @return
+     */
+    QImage getThumbnail(const QString &url);
+
+    void setMaxConcurrentDownloads(int count);
+    /**
+     * @brief Only the newest count image pushes are prefetched
+     * @param count
+     */
+    void setMaxCount(int count);
+    /**
+     * @brief Downloads stop once this many bytes are fetched in one budget window. Files that don't fit are aborted
+     * and not tried again in the same window.
+     * @param bytes
+     */
+    void setMaxBytes(qint64 bytes);
+    /**
+     * @brief The budget of setMaxBytes() starts over after this many milliseconds, 24 hours by default
+     * @param msecs
+     */
+    void setBudgetWindow(qint64 msecs);
+    void setThumbnailSize(QSize size);
+};
+
+#endif // PUSHBULLETPREFETCHER_H
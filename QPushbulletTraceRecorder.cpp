@@ -0,0 +1,146 @@
+#include "QPushbulletTraceRecorder.h"
+#include "QPushbulletLogging.h"
+#include <QDebug>
+
+QPushbulletTraceRecorder::QPushbulletTraceRecorder(QString filePath, QObject *parent)
+    : QObject(parent)
+    , m_File(filePath)
+    , m_RecordCount(0)
+{
+}
+
+QPushbulletTraceRecorder::~QPushbulletTraceRecorder()
+{
+    close();
+}
+
+bool QPushbulletTraceRecorder::open()
+{
+    if (!m_File.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qCWarning(lcPushbulletTools) << m_File.errorString();
+        return false;
+    }
+
+    m_Stream.setDevice(&m_File);
+    m_Stream.setVersion(QDataStream::Qt_5_0);
+    m_Stream << TRACE_MAGIC << TRACE_VERSION;
+    m_RecordCount = 0;
+    m_Clock.start();
+    return true;
+}
+
+void QPushbulletTraceRecorder::close()
+{
+    if (!m_File.isOpen())
+        return;
+
+    m_Stream.setDevice(nullptr);
+    m_File.close();
+}
+
+bool QPushbulletTraceRecorder::isOpen() const
+{
+    return m_File.isOpen();
+}
+
+int QPushbulletTraceRecorder::getRecordCount() const
+{
+    return m_RecordCount;
+}
+
+void QPushbulletTraceRecorder::addRedaction(const QByteArray &value)
+{
+    if (!value.isEmpty() && !m_Redactions.contains(value))
+        m_Redactions.append(value);
+}
+
+QByteArray QPushbulletTraceRecorder::redact(QByteArray data) const
+{
+    for (const QByteArray &value : m_Redactions)
+        data.replace(value, "<redacted>");
+    return data;
+}
+
+void QPushbulletTraceRecorder::recordReply(int operation, int status, const QByteArray &etag, const QByteArray &data)
+{
+    TraceRecord record;
+    record.kind = TraceRecord::KIND::REPLY;
+    record.operation = operation;
+    record.status = status;
+    record.etag = etag;
+    record.data = data;
+    write(record);
+}
+
+void QPushbulletTraceRecorder::recordError(int operation, int status, const QByteArray &data)
+{
+    TraceRecord record;
+    record.kind = TraceRecord::KIND::FAILED_REPLY;
+    record.operation = operation;
+    record.status = status;
+    record.data = data;
+    write(record);
+}
+
+void QPushbulletTraceRecorder::recordStreamMessage(const QString &message)
+{
+    TraceRecord record;
+    record.kind = TraceRecord::KIND::STREAM_MESSAGE;
+    record.operation = -1;
+    record.status = 0;
+    record.data = message.toUtf8();
+    write(record);
+}
+
+void QPushbulletTraceRecorder::write(const TraceRecord &record)
+{
+    if (!m_File.isOpen())
+        return;
+
+    m_Stream << static_cast<quint8>(record.kind) << static_cast<qint64>(m_Clock.nsecsElapsed() / 1000)
+             << static_cast<qint32>(record.operation) << static_cast<qint32>(record.status) << record.etag
+             << qCompress(redact(record.data));
+    m_RecordCount++;
+}
+
+TraceRecordList QPushbulletTraceRecorder::readTrace(QString filePath, bool *ok)
+{
+    TraceRecordList records;
+    if (ok)
+        *ok = false;
+
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly))
+        return records;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0;
+    quint16 version = 0;
+    stream >> magic >> version;
+    if (magic != TRACE_MAGIC || version != TRACE_VERSION)
+        return records;
+
+    while (!stream.atEnd()) {
+        quint8 kind = 0;
+        qint64 timestamp = 0;
+        qint32 operation = 0, status = 0;
+        QByteArray etag, data;
+        stream >> kind >> timestamp >> operation >> status >> etag >> data;
+        if (stream.status() != QDataStream::Ok)
+            break;
+
+        TraceRecord record;
+        record.kind = static_cast<TraceRecord::KIND>(kind);
+        record.timestamp = timestamp;
+        record.operation = operation;
+        record.status = status;
+        record.etag = etag;
+        record.data = qUncompress(data);
+        records.append(record);
+    }
+
+    if (ok)
+        *ok = stream.status() == QDataStream::Ok;
+    return records;
+}
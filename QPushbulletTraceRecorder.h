@@ -0,0 +1,75 @@
+#ifndef PUSHBULLETTRACERECORDER_H
+#define PUSHBULLETTRACERECORDER_H
+#include <QObject>
+#include <QtCore>
+
+struct TraceRecord {
+    enum class KIND {
+        REPLY,
+        FAILED_REPLY,
+        STREAM_MESSAGE
+    };
+
+    KIND kind;
+    //Microseconds since the recording started
+    qint64 timestamp;
+    //QPushbulletHandler::CURRENT_OPERATION of the reply, unused for stream messages
+    int operation, status;
+    QByteArray etag, data;
+};
+
+typedef QList<TraceRecord> TraceRecordList;
+
+/**
+ * @brief Writes the replies and stream messages a QPushbulletHandler sees to a compact binary trace, with their timing.
+ * Bodies are compressed and every redacted value (the API key by default) is replaced before it's written.
+ * Use QPushbulletTraceReplayer to feed the trace back into a handler.
+ */
+class QPushbulletTraceRecorder : public QObject
+{
+    Q_OBJECT
+
+public:
+    static const quint32 TRACE_MAGIC = 0x50425452;
+    static const quint16 TRACE_VERSION = 1;
+
+    QPushbulletTraceRecorder(QString filePath, QObject *parent = nullptr);
+    ~QPushbulletTraceRecorder();
+
+private:
+    QFile m_File;
+    QDataStream m_Stream;
+    QElapsedTimer m_Clock;
+    QList<QByteArray> m_Redactions;
+    int m_RecordCount;
+
+private:
+    void write(const TraceRecord &record);
+    QByteArray redact(QByteArray data) const;
+
+public:
+    bool open();
+    void close();
+    bool isOpen() const;
+    int getRecordCount() const;
+
+    /**
+     * @brief Every occurrence of value is replaced with "<redacted>" in the recorded data
+     * @param value
+     */
+    void addRedaction(const QByteArray &value);
+
+    void recordReply(int operation, int status, const QByteArray &etag, const QByteArray &data);
+    void recordError(int operation, int status, const QByteArray &data);
+    void recordStreamMessage(const QString &message);
+
+    /**
+     * @brief Reads all of the records in a trace file
+     * @param filePath
+     * @param ok Set to false if the file cannot be read or isn't a trace
+     * @return
+     */
+    static TraceRecordList readTrace(QString filePath, bool *ok = nullptr);
+};
+
+#endif // PUSHBULLETTRACERECORDER_H
@@ -0,0 +1,101 @@
+#include "QPushbulletTraceReplayer.h"
+#include "QPushbulletLogging.h"
+#include <QDebug>
+#include <QElapsedTimer>
+
+QPushbulletTraceReplayer::QPushbulletTraceReplayer(QPushbulletHandler *handler, QObject *parent)
+    : QObject(parent)
+    , m_Handler(handler)
+    , m_NextRecord(0)
+    , m_Speed(1.0)
+{
+    m_Timer.setSingleShot(true);
+    connect(&m_Timer, SIGNAL(timeout()), this, SLOT(replayDueRecords()));
+}
+
+bool QPushbulletTraceReplayer::load(QString filePath)
+{
+    bool ok = false;
+    m_Records = QPushbulletTraceRecorder::readTrace(filePath, &ok);
+    m_NextRecord = 0;
+    return ok;
+}
+
+int QPushbulletTraceReplayer::getRecordCount() const
+{
+    return m_Records.count();
+}
+
+void QPushbulletTraceReplayer::start(double speed)
+{
+    m_Speed = qMax(0.0, speed);
+    m_NextRecord = 0;
+    m_Handler->m_OfflineMode = true;
+    m_Clock.start();
+    m_Timer.start(0);
+}
+
+void QPushbulletTraceReplayer::stop()
+{
+    m_Timer.stop();
+    m_Handler->m_OfflineMode = false;
+}
+
+bool QPushbulletTraceReplayer::isRunning() const
+{
+    return m_Timer.isActive();
+}
+
+void QPushbulletTraceReplayer::replayDueRecords()
+{
+    //When replaying back to back, give the event loop a turn every few records so queued slots still run
+    int replayed = 0;
+    while (m_NextRecord < m_Records.count()) {
+        const TraceRecord &record = m_Records.at(m_NextRecord);
+        if (m_Speed > 0) {
+            const qint64 dueAt = static_cast<qint64>(record.timestamp / m_Speed);
+            const qint64 now = m_Clock.nsecsElapsed() / 1000;
+            if (dueAt > now) {
+                m_Timer.start(static_cast<int>((dueAt - now) / 1000));
+                return;
+            }
+        }
+        else if (replayed == 256) {
+            m_Timer.start(0);
+            return;
+        }
+
+        m_NextRecord++;
+        replayed++;
+        replay(record);
+    }
+
+    m_Handler->m_OfflineMode = false;
+    emit didFinishReplay();
+}
+
+void QPushbulletTraceReplayer::replay(const TraceRecord &record)
+{
+    if (record.kind == TraceRecord::KIND::STREAM_MESSAGE) {
+        m_Handler->textMessageReceived(QString::fromUtf8(record.data));
+    }
+    else if (record.kind == TraceRecord::KIND::REPLY) {
+        m_Handler->m_CurrentOperation = static_cast<QPushbulletHandler::CURRENT_OPERATION>(record.operation);
+        //Recorded like handleNetworkData() does, so getMetrics() has the parse times of replayed replies
+        const QString operation = QPushbulletHandler::getOperationName(m_Handler->m_CurrentOperation);
+        m_Handler->m_Metrics.recordReply(operation, false, record.data.size(), -1);
+        QElapsedTimer parseTimer;
+        parseTimer.start();
+        m_Handler->processResponse(record.data, record.status == 304, record.etag);
+        m_Handler->m_Metrics.recordParse(operation, parseTimer.nsecsElapsed() / 1000);
+        m_Handler->m_CurrentOperation = QPushbulletHandler::CURRENT_OPERATION::NONE;
+        emit m_Handler->didFinishRequest();
+    }
+    else {
+        //There is no QNetworkReply to hand to didReceiveError, so failed replies are only logged and counted
+        qCWarning(lcPushbulletTools) << "Replayed failed reply with status" << record.status;
+        const QString operation = QPushbulletHandler::getOperationName(
+                    static_cast<QPushbulletHandler::CURRENT_OPERATION>(record.operation));
+        m_Handler->m_Metrics.recordReply(operation, true, record.data.size(), -1);
+    }
+}
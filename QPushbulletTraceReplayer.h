@@ -0,0 +1,49 @@
+#ifndef PUSHBULLETTRACEREPLAYER_H
+#define PUSHBULLETTRACEREPLAYER_H
+#include <QObject>
+#include "QPushbulletHandler.h"
+#include "QPushbulletTraceRecorder.h"
+
+/**
+ * @brief Feeds a trace written by QPushbulletTraceRecorder back into a handler without the network. The handler is put
+ * into offline mode while replaying, so the requests it makes (e.g. after a tickle) are dropped and the recorded replies
+ * are used instead.
+ */
+class QPushbulletTraceReplayer : public QObject
+{
+    Q_OBJECT
+
+public:
+    QPushbulletTraceReplayer(QPushbulletHandler *handler, QObject *parent = nullptr);
+
+private:
+    QPushbulletHandler *m_Handler;
+    TraceRecordList m_Records;
+    int m_NextRecord;
+    double m_Speed;
+    QElapsedTimer m_Clock;
+    QTimer m_Timer;
+
+signals:
+    void didFinishReplay();
+
+private slots:
+    void replayDueRecords();
+
+private:
+    void replay(const TraceRecord &record);
+
+public:
+    bool load(QString filePath);
+    int getRecordCount() const;
+
+    /**
+     * @brief Starts replaying from the first record
+     * @param speed 1 replays with the recorded timing, 10 is ten times faster. 0 replays the records back to back.
+     */
+    void start(double speed = 1.0);
+    void stop();
+    bool isRunning() const;
+};
+
+#endif // PUSHBULLETTRACEREPLAYER_H
@@ -0,0 +1,33 @@
+QT += core network websockets
+QT -= gui
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TARGET = benchmark
+TEMPLATE = app
+
+LIBS += -lcrypto
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+    ../QPushbulletBenchmark.cpp \
+    ../QPushbulletCrypto.cpp \
+    ../QPushbulletFileCache.cpp \
+    ../QPushbulletHandler.cpp \
+    ../QPushbulletLogging.cpp \
+    ../QPushbulletMetrics.cpp \
+    ../QPushbulletMockServer.cpp \
+    ../QPushbulletTraceRecorder.cpp
+
+HEADERS += \
+    ../QPushbulletBenchmark.h \
+    ../QPushbulletCrypto.h \
+    ../QPushbulletFileCache.h \
+    ../QPushbulletFuture.h \
+    ../QPushbulletHandler.h \
+    ../QPushbulletLogging.h \
+    ../QPushbulletMetrics.h \
+    ../QPushbulletMockServer.h \
+    ../QPushbulletTraceRecorder.h
@@ -0,0 +1,23 @@
+#include <QCoreApplication>
+#include <iostream>
+#include "QPushbulletBenchmark.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    //Pass --quick for a short run, e.g. to check the build
+    const bool quick = app.arguments().contains("--quick");
+
+    QPushbulletBenchmark benchmark;
+    BenchmarkResultList results;
+    if (quick)
+        results = benchmark.runHistorySync({1000, 10000}, 3);
+    else
+        results = benchmark.runHistorySync({1000, 10000, 100000, 1000000}, 5);
+    results.append(benchmark.runPushThroughput(quick ? 50 : 500));
+    results.append(benchmark.runDeviceSync(quick ? 20 : 100));
+    results.append(benchmark.runMirrorThroughput(quick ? 1000 : 10000));
+    results.append(benchmark.runEncryptedMirrorThroughput(quick ? 1000 : 10000));
+    std::cout << QPushbulletBenchmark::toText(results).toStdString();
+    return 0;
+}